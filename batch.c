@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "fat12.h"
+#include "fat12_internal.h"
+
+// run the same script of read-only commands on many images, each image by one of the worker threads
+// output of each image is written as a block in the order images are given:
+//   === {index} {image}
+//   --- {command}
+//   {output of the command}
+//   !!! failed              (only when the command failed)
+//   === {index} ok          (or "=== {index} failed {number of failed commands}",
+//                            or "=== {index} error" if the image can not be read or mounted)
+
+static void printUsage() {
+    printf("usage: fat12_batch [-j workers] [-l list] script [image ...]\n");
+    printf("  -j workers   -- number of worker threads. (default: number of CPUs to use)\n");
+    printf("  -l list      -- read image names from {list}, one per line. (\"-\" for stdin)\n");
+    printf("commands of the script, one per line (\"#\" starts a comment line):\n");
+    printf("info        -- print FAT12 header infomation of the disk.\n");
+    printf("bootable    -- check if the floppy is bootable. (by verifying 0x55AA)\n");
+    printf("ls          -- list all file and sub-directory in current directory.\n");
+    printf("cd {path}   -- change current directory to {path}.\n");
+    printf("type {file} -- print the content of {file}. (decode as ASCII)\n");
+    printf("tree        -- print directory tree of current directory.\n");
+    printf("fsck        -- check the file system and print problems found.\n");
+    printf("export {path} {host path}-- copy {path} file or directory out of the image to {host path},\n");
+    printf("               where \"%%n\" is replaced by the image name, and \"%%i\" by its index.\n");
+}
+
+enum command_op { OP_INFO, OP_BOOTABLE, OP_LS, OP_CD, OP_TYPE, OP_TREE, OP_FSCK, OP_EXPORT };
+
+static const struct {
+    const char* name;
+    int argc;
+} command_table[] = {
+    { "info", 0 }, { "bootable", 0 }, { "ls", 0 }, { "cd", 1 },
+    { "type", 1 }, { "tree", 0 }, { "fsck", 0 }, { "export", 2 },
+};
+
+// a line of the script, parsed once before any image is opened
+typedef struct command {
+    int op;
+    char* line; // as written, without the line break
+    char* args[2];
+} command;
+
+// output of an image, filled by a worker and written by the main thread
+typedef struct image_result {
+    char* text;
+    size_t len;
+    int failed; // number of failed commands, or -1 if the image can not be read or mounted
+    int done;
+} image_result;
+
+typedef struct batch {
+    char** images;
+    int image_count;
+    command* commands;
+    int command_count;
+    image_result* results;
+    int next_image; // index of the next image to be taken by a worker
+    // `done` of results is changed and waited with this
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+} batch;
+
+// read lines of the file (stdin for "-") into `*lines`, empty lines are skipped
+// return number of lines, or -1 if the file can not be read
+static int readLines(const char* file_name, char*** lines) {
+    FILE* fp = strcmp(file_name, "-") ? fopen(file_name, "r") : stdin;
+    if (!fp) return -1;
+    int count = 0, max_count = 16;
+    *lines = (char**)malloc(sizeof(char*) * max_count);
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        if (len == 0) continue;
+        if (count == max_count) {
+            max_count *= 2;
+            *lines = (char**)realloc(*lines, sizeof(char*) * max_count);
+        }
+        (*lines)[count++] = strdup(line);
+    }
+    free(line);
+    if (fp != stdin) fclose(fp);
+    return count;
+}
+
+// split the line into a command, return 1 when success, else print why and return 0
+static int parseCommand(char* line, command* cmd) {
+    char* words[4];
+    int word_count = 0;
+    char* copy = strdup(line);
+    for (char* word = strtok(copy, " \t"); word; word = strtok(NULL, " \t")) {
+        if (word_count == 4) break;
+        words[word_count++] = word;
+    }
+    if (word_count == 0) {
+        fprintf(stderr, "Empty command: %s\n", line);
+        free(copy);
+        return 0;
+    }
+    for (int op = 0; op < (int)(sizeof(command_table) / sizeof(command_table[0])); ++op) {
+        if (strcmp(words[0], command_table[op].name)) continue;
+        if (word_count - 1 != command_table[op].argc) {
+            fprintf(stderr, "Command \"%s\" takes %d arguments: %s\n", words[0], command_table[op].argc, line);
+            free(copy);
+            return 0;
+        }
+        cmd->op = op;
+        cmd->line = line;
+        for (int i = 0; i < 2; ++i) cmd->args[i] = (i + 1 < word_count) ? strdup(words[i + 1]) : NULL;
+        free(copy);
+        return 1;
+    }
+    fprintf(stderr, "Unkown command: %s\n", words[0]);
+    free(copy);
+    return 0;
+}
+
+// replace "%n" in `pattern` by name of the image (without directories) and "%i" by its index
+static char* expandHostPath(const char* pattern, const char* image, int index) {
+    const char* base = strrchr(image, '/');
+    base = base ? base + 1 : image;
+    size_t max_len = strlen(pattern) + 1;
+    for (const char* p = pattern; (p = strstr(p, "%")); ++p) max_len += strlen(base) + 12;
+    char* path = (char*)malloc(max_len);
+    char* q = path;
+    for (const char* p = pattern; *p; ++p) {
+        if (p[0] == '%' && p[1] == 'n') {
+            q += sprintf(q, "%s", base);
+            ++p;
+        } else if (p[0] == '%' && p[1] == 'i') {
+            q += sprintf(q, "%d", index);
+            ++p;
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q = '\0';
+    return path;
+}
+
+// return 1 when the command succeed, else return 0
+static int runCommand(const command* cmd, volume* vol, directory* dir, const char* image, int index, FILE* out) {
+    switch (cmd->op) {
+    case OP_INFO:
+        fprintFat12Info(out, vol->disk);
+        return 1;
+    case OP_BOOTABLE:
+        fprintf(out, verifyBootId(vol->disk) ? "This image is bootable.\n" : "This image is NOT bootable.\n");
+        return 1;
+    case OP_LS:
+        fprintAllInDir(out, vol, dir);
+        return 1;
+    case OP_CD:
+        return changeDirectory(vol, dir, cmd->args[0]);
+    case OP_TYPE:
+        return fprintFileContentByPath(out, vol, dir, cmd->args[0]);
+    case OP_TREE:
+        fprintDirTree(out, vol, dir);
+        return 1;
+    case OP_FSCK: {
+        int problems = checkVolume(vol, out);
+        if (problems >= 0) fprintf(out, "%d problems found.\n", problems);
+        return problems == 0;
+    }
+    case OP_EXPORT: {
+        char* host_path = expandHostPath(cmd->args[1], image, index);
+        int ok = exportByPath(vol, dir, cmd->args[0], host_path);
+        free(host_path);
+        return ok;
+    }
+    }
+    return 0;
+}
+
+// run the script on the image, return number of failed commands, or -1 if the image can not be used
+static int runScript(const batch* b, int index, FILE* out) {
+    const char* image = b->images[index];
+    floppy disk;
+    if (!mapFloppyDisk(image, &disk, 1)) {
+        fprintf(out, "!!! Failed to read image from file.\n");
+        destroyFloppyDisk(&disk);
+        return -1;
+    }
+    volume vol;
+    if (!mountVolume(&vol, &disk)) {
+        fprintf(out, "!!! Failed to mount FAT12 file system of the image.\n");
+        unmountVolume(&vol);
+        destroyFloppyDisk(&disk);
+        return -1;
+    }
+    directory dir;
+    initDirWithRoot(&dir);
+    int failed = 0;
+    for (int i = 0; i < b->command_count; ++i) {
+        fprintf(out, "--- %s\n", b->commands[i].line);
+        if (!runCommand(&b->commands[i], &vol, &dir, image, index, out)) {
+            fprintf(out, "!!! failed\n");
+            ++failed;
+        }
+    }
+    destroyDir(&dir);
+    unmountVolume(&vol);
+    destroyFloppyDisk(&disk);
+    return failed;
+}
+
+// ask the kernel to start reading the image, so that it is (mostly) in page cache once it is mapped
+static void prefetchImage(const char* image) {
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+// each worker takes the next image before running the current one, and prefetches it,
+// so that reading an image from disk overlaps running the script on the one before
+static void* batchWorker(void* arg) {
+    batch* b = (batch*)arg;
+    int index = __atomic_fetch_add(&b->next_image, 1, __ATOMIC_RELAXED);
+    while (index < b->image_count) {
+        int next = __atomic_fetch_add(&b->next_image, 1, __ATOMIC_RELAXED);
+        if (next < b->image_count) prefetchImage(b->images[next]);
+        image_result* result = &b->results[index];
+        FILE* out = open_memstream(&result->text, &result->len);
+        if (out) {
+            result->failed = runScript(b, index, out);
+            fclose(out);
+        } else {
+            // the image is reported as an error by the main thread, as there is nowhere to write why
+            result->text = NULL;
+            result->len = 0;
+            result->failed = -1;
+        }
+        pthread_mutex_lock(&b->lock);
+        result->done = 1;
+        pthread_cond_signal(&b->done_cond);
+        pthread_mutex_unlock(&b->lock);
+        index = next;
+    }
+    return NULL;
+}
+
+// free the parsed commands and lines of the script
+static void destroyScript(command* commands, int command_count, char** lines, int line_count) {
+    for (int i = 0; i < command_count; ++i) {
+        free(commands[i].args[0]);
+        free(commands[i].args[1]);
+    }
+    free(commands);
+    for (int i = 0; i < line_count; ++i) free(lines[i]);
+    free(lines);
+}
+
+int main(int argc, char** argv) {
+    int worker_count = 0;
+    const char* list_name = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:l:h")) != -1) {
+        if (opt == 'j') {
+            worker_count = atoi(optarg);
+        } else if (opt == 'l') {
+            list_name = optarg;
+        } else {
+            printUsage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind >= argc) {
+        printUsage();
+        return 2;
+    }
+
+    batch b;
+    memset(&b, 0, sizeof(batch));
+    char** lines;
+    int line_count = readLines(argv[optind], &lines);
+    if (line_count < 0) {
+        fprintf(stderr, "Failed to read script \"%s\"\n", argv[optind]);
+        return 2;
+    }
+    b.commands = (command*)malloc(sizeof(command) * (line_count ? line_count : 1));
+    for (int i = 0; i < line_count; ++i) {
+        char* line = lines[i] + strspn(lines[i], " \t");
+        if (*line == '\0' || *line == '#') continue;
+        if (!parseCommand(line, &b.commands[b.command_count])) {
+            destroyScript(b.commands, b.command_count, lines, line_count);
+            return 2;
+        }
+        ++b.command_count;
+    }
+
+    // images in the list go first, followed by those in arguments
+    int listed_count = 0;
+    if (list_name) {
+        listed_count = readLines(list_name, &b.images);
+        if (listed_count < 0) {
+            fprintf(stderr, "Failed to read image list \"%s\"\n", list_name);
+            destroyScript(b.commands, b.command_count, lines, line_count);
+            return 2;
+        }
+        b.image_count = listed_count;
+    }
+    b.images = (char**)realloc(b.images, sizeof(char*) * (b.image_count + argc - optind));
+    for (int i = optind + 1; i < argc; ++i) b.images[b.image_count++] = argv[i];
+
+    b.results = (image_result*)calloc(b.image_count ? b.image_count : 1, sizeof(image_result));
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.done_cond, NULL);
+    if (worker_count <= 0) worker_count = usableCpuCount();
+    if (worker_count > b.image_count) worker_count = b.image_count;
+    pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * (worker_count ? worker_count : 1));
+    int started = 0;
+    while (started < worker_count && pthread_create(&workers[started], NULL, batchWorker, &b) == 0) ++started;
+    // images are taken by the workers started, or by the main thread itself if none could be started
+    if (started == 0) batchWorker(&b);
+
+    // blocks are written by the main thread in order, each as soon as it and those before it are done
+    static char out_buffer[1 << 20];
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    int failed_images = 0;
+    for (int i = 0; i < b.image_count; ++i) {
+        image_result* result = &b.results[i];
+        pthread_mutex_lock(&b.lock);
+        while (!result->done) pthread_cond_wait(&b.done_cond, &b.lock);
+        pthread_mutex_unlock(&b.lock);
+        printf("=== %d %s\n", i, b.images[i]);
+        if (result->text) fwrite(result->text, 1, result->len, stdout);
+        else printf("!!! Failed to alloc memory for output of the image.\n");
+        if (result->failed == 0) {
+            printf("=== %d ok\n", i);
+        } else {
+            if (result->failed < 0) printf("=== %d error\n", i);
+            else printf("=== %d failed %d\n", i, result->failed);
+            ++failed_images;
+        }
+        free(result->text);
+    }
+    fflush(stdout);
+
+    for (int i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_cond_destroy(&b.done_cond);
+    pthread_mutex_destroy(&b.lock);
+    free(b.results);
+    for (int i = 0; i < listed_count; ++i) free(b.images[i]);
+    free(b.images);
+    destroyScript(b.commands, b.command_count, lines, line_count);
+    // 1 if the script failed on any image
+    return failed_images ? 1 : 0;
+}
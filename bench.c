@@ -0,0 +1,90 @@
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <time.h>
+# include "fat12.h"
+# include "fat12_internal.h"
+
+// time the hot internal paths on an image: reading whole files by entry and looking names up in directories
+// usage: fat12_bench image [rounds], and the result is usually kept in bench_output.txt
+
+static double nowInUs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage: fat12_bench image [rounds]\n");
+        return 2;
+    }
+    int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+    if (rounds < 1) rounds = 1;
+    floppy disk;
+    volume vol;
+    if (!readFloppyDisk(argv[1], &disk) || !mountVolume(&vol, &disk)) {
+        printf("Failed to read or mount image \"%s\"\n", argv[1]);
+        return 1;
+    }
+
+    ent_tree tree;
+    if (!getEntTree(&vol, 0, &tree)) {
+        printf("Failed to alloc memory to walk image \"%s\"\n", argv[1]);
+        unmountVolume(&vol);
+        destroyFloppyDisk(&disk);
+        return 1;
+    }
+    BYTE* buf = (BYTE*)malloc(FLOPPY_SIZE);
+    DWORD file_count = 0, dir_count = 0;
+    size_t bytes = 0;
+    for (DWORD i = 1; i < tree.size; ++i) {
+        const file_entry* ent = &tree.storage[i].ent;
+        if (ent->DIR_Attr & FILE_ATTR_DIR) ++dir_count;
+        else {
+            ++file_count;
+            bytes += ent->DIR_FileSize;
+        }
+    }
+
+    // every file of the image read as a whole, once per round
+    int failed = 0;
+    double start = nowInUs();
+    for (int r = 0; r < rounds; ++r) {
+        for (DWORD i = 1; i < tree.size; ++i) {
+            const file_entry* ent = &tree.storage[i].ent;
+            if (!(ent->DIR_Attr & FILE_ATTR_DIR) && !readFileContentByEnt(&vol, ent, buf)) ++failed;
+        }
+    }
+    double read_us = nowInUs() - start;
+
+    // every name looked up in its directory, once per round
+    DWORD lookups = 0;
+    ent_ref ref;
+    start = nowInUs();
+    for (int r = 0; r < rounds; ++r) {
+        for (DWORD k = 0; k < tree.size; ++k) {
+            const ent_tree_node* node = &tree.storage[k];
+            if (!(node->ent.DIR_Attr & FILE_ATTR_DIR)) continue;
+            for (DWORD i = node->first_child; i < node->first_child + node->child_count; ++i) {
+                if (!getFileEntRefByFATName(&vol, node->ent.DIR_FstClus, tree.storage[i].ent.DIR_Name, &ref)) ++failed;
+                ++lookups;
+            }
+        }
+    }
+    double lookup_us = nowInUs() - start;
+
+    printf("image:   %s (%u files, %u directories, %zu bytes, %d rounds)\n",
+        argv[1], file_count, dir_count, bytes, rounds);
+    if (file_count) {
+        printf("read:    %.3f us/file, %.1f MB/s\n", read_us / rounds / file_count, bytes * (double)rounds / read_us);
+    }
+    if (lookups) printf("lookup:  %.3f us/name\n", lookup_us / lookups);
+    if (failed) printf("failed:  %d\n", failed);
+
+    free(buf);
+    entTreeDestroy(&tree);
+    unmountVolume(&vol);
+    destroyFloppyDisk(&disk);
+    return failed ? 1 : 0;
+}
@@ -1,6 +1,10 @@
 # ifndef FAT12_H_
 # define FAT12_H_
 
+# include <stdio.h>
+# include <sys/types.h>
+# include <pthread.h>
+
 # define BYTE    unsigned char
 # define WORD    unsigned short
 # define DWORD   unsigned int
@@ -10,10 +14,98 @@
 // 1.44MB = 2880 x 512B
 # define FLOPPY_SIZE 1474560
 
+// unit of dirty tracking, written back as a whole when any byte in it is changed
+# define DIRTY_UNIT_SIZE 512
+# define DIRTY_UNIT_COUNT (FLOPPY_SIZE / DIRTY_UNIT_SIZE)
+
+// directory locks of a volume, a directory uses the one indexed by its head cluster number modulo this
+# define DIR_LOCK_COUNT 64
+
+// a run of free clusters [start, start + len)
+typedef struct free_extent {
+    WORD    start;
+    WORD    len;
+} free_extent;
+
+// location of an entry in the image
+typedef struct ent_loc {
+    WORD logic_sec_num; // logic sector number the entry is in
+    WORD slot; // index of the entry in the sector
+    DWORD ent_num; // index of the entry in the directory
+} ent_loc;
+
 typedef struct floppy {
-    BYTE    storage[FLOPPY_SIZE];
+    // `FLOPPY_SIZE` bytes of image, either on heap or mapped from the image file
+    BYTE*   storage;
+    // if `storage` is mapped by `mapFloppyDisk` (else it is allocated by `readFloppyDisk`)
+    int     mapped;
+    // if `storage` can not be written, all operations changing the disk would fail
+    int     read_only;
+    // bitmap of units changed since the image was read or written
+    BYTE    dirty_map[DIRTY_UNIT_COUNT / 8];
+    // the image file `storage` was last read from or written to
+    int     has_source;
+    dev_t   source_dev;
+    ino_t   source_ino;
+    // versions kept for snapshots from the oldest to the newest, NULL if no snapshot is open
+    struct floppy_version*  oldest_version;
+    struct floppy_version*  newest_version;
+    // taken to add, free or save units into versions
+    pthread_mutex_t         version_lock;
 } floppy;
 
+// a FAT12 file system mounted on a floppy, all derived geometry is computed once by `mountVolume`
+typedef struct volume {
+    floppy* disk;
+
+    WORD    bytes_per_sec;
+    WORD    sec_per_clus;
+    DWORD   bytes_per_clus;
+    // assume bytes_per_clus is a multiple of sizeof(file_entry)
+    WORD    entries_per_clus;
+    // log2 of the sizes above, or -1 if the size is not a power of 2
+    int     bytes_per_sec_shift;
+    int     sec_per_clus_shift;
+    int     bytes_per_clus_shift;
+
+    BYTE    num_FATs;
+    WORD    secs_per_FAT;
+    // FAT1 is located at the second sector (which is after MBR sector)
+    WORD    FAT_head_sec;
+    WORD    root_head_sec;
+    WORD    root_sectors;
+    WORD    max_root_entries;
+    WORD    data_head_sec;
+
+    // FAT decoded at mount, indexed by cluster number
+    WORD*   FAT;
+    // number of entries in `FAT`, which is also the upper bound of cluster numbers
+    WORD    clus_count;
+    // if `FAT` has been changed and should be packed back to all FAT copies
+    int     FAT_changed;
+    // free clusters as runs sorted by start, adjacent runs are always merged
+    free_extent*    free_extents;
+    int     free_extent_count;
+    // total number of free clusters
+    WORD    free_clus_count;
+    // where the next small allocation starts searching
+    WORD    next_fit;
+    // name index of directories, indexed by head cluster number (0 for root), NULL if not built
+    struct dir_index**  dir_indexes;
+    // version of `disk` read through, NULL unless the volume is the view of a snapshot
+    struct floppy_version*  version;
+
+    // locks are always taken in the order they are listed here
+    // held shared by every operation, and exclusively by those changing the shape of the directory tree
+    pthread_rwlock_t    ns_lock;
+    // entries of a directory and content of files in it
+    pthread_rwlock_t    dir_locks[DIR_LOCK_COUNT];
+    // `FAT`, free extents and `FAT_changed`, which may also be changed when `ns_lock` is held exclusively
+    pthread_mutex_t     alloc_lock;
+    // building indexes and listings of directories on first access, which may happen under a shared lock
+    pthread_mutex_t     index_lock;
+} volume;
+
 typedef struct directory {
     // head cluster number of the directory. Use 0 to represent root.
     WORD    clus_num;
@@ -21,53 +113,163 @@ typedef struct directory {
     size_t  max_path_len;
 } directory;
 
-// return 1 when success, else return 0
+// a run of continuous clusters of a file, which are clusters [file_clus, file_clus + len) of the file
+typedef struct file_extent {
+    DWORD   file_clus;
+    WORD    start;
+    WORD    len;
+} file_extent;
+
+// an opened file which reads and writes its cluster chain in the image directly
+// the handle is invalid once the file is changed or removed by others
+// a handle can be used by one thread at a time, while handles of a volume can be used in parallel
+typedef struct file_handle {
+    // only written through when the handle is opened for write
+    volume* vol;
+    int     writable;
+    // where the entry of the file is, updated once at `closeFile` if `changed`
+    ent_loc loc;
+    // directory the file is in, whose lock protects the file
+    WORD    dir_clus_num;
+    int     changed;
+    WORD    head_clus_num;
+    DWORD   size;
+    // extent map of the chain built at open, so that seeking is a binary search in it
+    file_extent*    extents;
+    int     extent_count;
+    int     extent_max;
+    // current position in bytes
+    DWORD   pos;
+    // the extent holding byte `pos`, or the last one when `pos` is at the end of the chain
+    int     extent_index;
+} file_handle;
+
+// read the whole image into memory, return 1 when success, else return 0
 int readFloppyDisk(const char* file_name, floppy* disk);
 
+// map the image file instead of reading it, so that only sectors used are loaded
+// a read-only image is shared with other processes, otherwise the mapping is private
+// and changes are saved by `writeFloppyDisk`. return 1 when success, else return 0
+int mapFloppyDisk(const char* file_name, floppy* disk, int read_only);
+
 // return 1 when success, else return 0
-int writeFloppyDisk(const char* file_name, const floppy* disk);
+// when writing to the same file the image was read from, only changed sectors are written
+int writeFloppyDisk(const char* file_name, floppy* disk);
+
+// return 1 if the image has been changed since it was read or written, else return 0
+int floppyDiskChanged(const floppy* disk);
+
+// free memory allocated in `readFloppyDisk` or `mapFloppyDisk`
+void destroyFloppyDisk(floppy* disk);
 
 // return 1 if the floppy image is bootable, else return 0
 int verifyBootId(const floppy* disk);
 
 void printFat12Info(const floppy* p);
 
+// functions named `fprint...` write to `out`, and those named `print...` write to stdout
+void fprintFat12Info(FILE* out, const floppy* p);
+
+// check the header and mount the file system on the floppy, return 1 when success, else return 0
+// functions below taking a volume can be called from multiple threads once it is mounted
+int mountVolume(volume* vol, floppy* disk);
+
+// pack changes of the decoded FAT back to the floppy, should be called before writing the floppy
+// return 1 when success, else return 0
+int flushVolume(volume* vol);
+
+// free memory allocated in `mountVolume`, changes not flushed are dropped
+void unmountVolume(volume* vol);
+
 void initDirWithRoot(directory* dir);
 
-void printAllInDir(const floppy* disk, const directory* dir);
+void printAllInDir(const volume* vol, const directory* dir);
+
+void fprintAllInDir(FILE* out, const volume* vol, const directory* dir);
+
+void printDirTree(const volume* vol, const directory* dir);
 
-void printDirTree(const floppy* disk, const directory* dir);
+void fprintDirTree(FILE* out, const volume* vol, const directory* dir);
 
 // return 1 when directory is changed successfully, else return 0
-int changeDirectory(const floppy* disk, directory* dir, const char* path);
+int changeDirectory(const volume* vol, directory* dir, const char* path);
 
 // return 1 in case success, else return 0
-int printFileContentByPath(const floppy* disk, const directory* dir, const char* path);
+int printFileContentByPath(const volume* vol, const directory* dir, const char* path);
+
+int fprintFileContentByPath(FILE* out, const volume* vol, const directory* dir, const char* path);
+
+// open file using path relative to directory, return 1 when success, else return 0
+// fail if it is a directory or its size doesn't match FAT record
+int openFileByPath(const volume* vol, const directory* dir, const char* path, file_handle* fh);
+
+// read at most `len` bytes from current position, return number of bytes read, which is 0 at the end
+size_t readFile(file_handle* fh, void* buf, size_t len);
+
+// get bytes from current position to the end of its run of continuous clusters (trimmed to the file size)
+// as a span pointing into the image without copying, and move current position after it
+// the span is valid until the image is changed, return 1 when a span is got, else return 0 at the end
+int nextFileSpan(file_handle* fh, const BYTE** ptr, size_t* len);
+
+// read at most `len` bytes from `offset` without moving current position, return number of bytes read
+size_t readFileAt(file_handle* fh, DWORD offset, void* buf, size_t len);
+
+// move current position to `pos`, return 1 when success, else return 0 (beyond the end)
+int seekFile(file_handle* fh, DWORD pos);
+
+// open an existing file for read and write, return 1 when success, else return 0
+int openFileForWriteByPath(volume* vol, const directory* dir, const char* path, file_handle* fh);
+
+// write `len` bytes at current position and move it, the chain is extended when writing beyond its end
+// return 1 when success, else return 0 and nothing is written (not opened for write, or disk is full)
+int writeFile(file_handle* fh, const void* buf, size_t len);
+
+// cut the file to `size` bytes, which should not be larger than the file
+// return 1 when success, else return 0
+int truncateFile(file_handle* fh, DWORD size);
+
+// write back size, head cluster and time of the file if it is changed, and free the extent map
+void closeFile(file_handle* fh);
 
 // copy file using path relative to directory, return 1 when succeed else return 0
-int copyFileByPath(floppy* disk, const directory* dir, const char* src, const char* des);
+int copyFileByPath(volume* vol, const directory* dir, const char* src, const char* des);
 
 // return 1 when succeed, else return 0
-int removeFileByPath(floppy* disk, const directory* dir, const char* path);
+int removeFileByPath(volume* vol, const directory* dir, const char* path);
 
 // move file or dir using path relative to directory, return 1 when succeed else return 0
-int moveFileByPath(floppy* disk, const directory* dir, const char* src, const char* des);
+int moveFileByPath(volume* vol, const directory* dir, const char* src, const char* des);
 
 // return 1 when succeed else return 0
-int makeDirByPath(floppy* disk, const directory* dir, const char* path);
+int makeDirByPath(volume* vol, const directory* dir, const char* path);
 
 // remove a directory (and everything in it). Return 1 when succeed else return 0
-int removeDirByPath(floppy* disk, const directory* dir, const char* path);
+int removeDirByPath(volume* vol, const directory* dir, const char* path);
 
 // concat content of two files to one new file, return 1 when succeed else return 0
-int concatFileByPath(floppy* disk, const directory* dir, 
+int concatFileByPath(volume* vol, const directory* dir, 
     const char* src1,
     const char* src2,
     const char* des) ;
 
-// return 1 when succeed else return 0
-// for convenience this is a completement with low efficiency
-int copyDirByPath(floppy* disk, const directory* dir, const char* src, const char* des);
+// append content of `src` file to the end of existing `des` file, return 1 when succeed else return 0
+int appendFileByPath(volume* vol, const directory* dir, const char* src, const char* des);
+
+// cut the file to `size` bytes, return 1 when succeed else return 0
+int truncateFileByPath(volume* vol, const directory* dir, const char* path, DWORD size);
+
+// copy a directory and everything in it to a new directory, return 1 when succeed else return 0
+int copyDirByPath(volume* vol, const directory* dir, const char* src, const char* des);
+
+// check the FAT and every cluster chain reached from root, and write a line to `out` for each problem found:
+// bad FAT entries, broken or looped chains, clusters shared by entries, sizes not matching chains,
+// and clusters allocated but not used by any entry. return number of problems found, or -1 if failed to alloc memory
+// writers are not stopped, so a chain growing after its directory is checked may be counted as lost clusters
+int checkVolume(const volume* vol, FILE* out);
+
+// copy a file, or a directory and everything in it, using path relative to directory out of the image
+// to `host_path` on the host. existing files are overwritten, return 1 when succeed else return 0
+int exportByPath(const volume* vol, const directory* dir, const char* path, const char* host_path);
 
 // free memory allocated in `initDirWithRoot`
 void destroyDir(directory* dir);
@@ -5,6 +5,8 @@
 
 # define EOF_CLUSTER_NUM 0xFFF
 # define NOT_USED_CLUSTER_NUM 0x000
+// a volume with this number of data clusters or more is FAT16
+# define FAT12_MAX_CLUSTERS 4085
 
 typedef struct fat12_header {
     BYTE    JmpCode[3];
@@ -48,9 +50,68 @@ typedef struct file_entry {
 # define FILE_ATTR_ARCH 0x20
 
 // to emulate the real way using BIOS
-void loadSectors(const floppy* disk, WORD logic_sec_num, WORD count, BYTE* buf);
-
-void writeSectors(floppy* disk, WORD logic_sec_num, WORD count, const BYTE* buf);
+void loadSectors(const volume* vol, WORD logic_sec_num, WORD count, BYTE* buf);
+
+void writeSectors(volume* vol, WORD logic_sec_num, WORD count, const BYTE* buf);
+
+// remember `fd` as the image file which has the same content as `disk->storage` now
+void setFloppyDiskSource(floppy* disk, int fd);
+
+// record that bytes [offset, offset + len) of the image are going to be changed
+// it should be called before changing them, so that open snapshots could keep the old content
+void markDirty(floppy* disk, size_t offset, size_t len);
+
+// units of the image as they were when the version was created
+typedef struct floppy_version {
+    // the next newer version
+    struct floppy_version* next;
+    // number of snapshots reading the version
+    int     readers;
+    DWORD   saved_count;
+    // copy of each unit taken before its first change after the version was created, NULL if not changed
+    BYTE*   saved[DIRTY_UNIT_COUNT];
+    // room of `FLOPPY_SIZE` bytes where the copies are kept, allocated with the version so that
+    // keeping a copy never fails in the middle of a change. Only the pages written are backed by memory
+    BYTE*   units;
+} floppy_version;
+
+// get the version of the image as it is now, which should be called when no change is in progress
+// return NULL if failed to alloc memory
+floppy_version* pinFloppyVersion(floppy* disk);
+
+// release a version got from `pinFloppyVersion`, and free versions no snapshot reads any more
+void unpinFloppyVersion(floppy* disk, floppy_version* version);
+
+// read bytes [offset, offset + len) of the image as they were in the version
+void readFloppyVersion(const floppy* disk, const floppy_version* version, size_t offset, size_t len, BYTE* buf);
+
+// free all versions, used when the floppy is destroyed
+void destroyFloppyVersions(floppy* disk);
+
+// write all dirty units to the opened image file, merging adjacent units into one write
+// return 1 when success, else return 0
+int writeDirtyUnits(floppy* disk, int fd);
+
+// return log2(n) if n is a power of 2, else return -1
+int log2OfPowerOf2(unsigned int n);
+
+// logic sector number of the head of data cluster `clus_num`
+# define clusToLogicSec(vol, clus_num) \
+    ((vol)->data_head_sec + ((vol)->sec_per_clus_shift >= 0 \
+        ? (((clus_num) - 2) << (vol)->sec_per_clus_shift) \
+        : ((clus_num) - 2) * (vol)->sec_per_clus))
+
+// number of clusters needed to hold `bytes` bytes (round up)
+# define bytesToClusCount(vol, bytes) \
+    ((vol)->bytes_per_clus_shift >= 0 \
+        ? (((bytes) + (vol)->bytes_per_clus - 1) >> (vol)->bytes_per_clus_shift) \
+        : ((bytes) + (vol)->bytes_per_clus - 1) / (vol)->bytes_per_clus)
+
+// bytes of image before logic sector `logic_sec_num`
+# define logicSecToOffset(vol, logic_sec_num) \
+    ((vol)->bytes_per_sec_shift >= 0 \
+        ? ((size_t)(logic_sec_num) << (vol)->bytes_per_sec_shift) \
+        : (size_t)(logic_sec_num) * (vol)->bytes_per_sec)
 
 // read the number at specific position of FAT12 record
 WORD readFATAtPosition(const BYTE* FAT, WORD pos);
@@ -58,7 +119,17 @@ WORD readFATAtPosition(const BYTE* FAT, WORD pos);
 // write the number to specific position of FAT12 record
 void writeFATAtPosition(BYTE* FAT, WORD pos, WORD num);
 
-WORD getNextClusNumFromFAT(const floppy* disk, WORD clus_num);
+// decode FAT1 into `vol->FAT`, return 1 when success, else return 0
+int loadFAT(volume* vol);
+
+// pack `vol->FAT` back into all FAT copies if it has been changed
+// return 1 when success, else return 0 (failed to alloc memory) and the image is not changed
+int flushFAT(volume* vol);
+
+WORD getNextClusNumFromFAT(const volume* vol, WORD clus_num);
+
+// change the decoded FAT, the change is written to image in `flushFAT`
+void setFATEntry(volume* vol, WORD clus_num, WORD num);
 
 # define clusNumIsBadClus(clus_num) \
     (0x0FF0 <= clus_num && clus_num <= 0x0FF7)
@@ -66,6 +137,10 @@ WORD getNextClusNumFromFAT(const floppy* disk, WORD clus_num);
 # define clusNumIsEOF(clus_num) \
     (0x0FF8 <= clus_num && clus_num <= 0x0FFF)
 
+// if the cluster number refers to a cluster in data area
+# define clusNumIsData(vol, clus_num) \
+    (2 <= (clus_num) && (clus_num) < (vol)->clus_count)
+
 void getWrtTimeFromFileEnt(
     const file_entry* ent, 
     int* year, int* month, int* date,
@@ -73,7 +148,7 @@ void getWrtTimeFromFileEnt(
 
 void setWrtTime(const struct tm* time, WORD* WrtTime, WORD* WrtDate);
 
-void printFileEnt(const file_entry* ent);
+void printFileEnt(FILE* out, const file_entry* ent);
 
 // ----------- a simple completement of C++ vector -----------
 
@@ -85,7 +160,8 @@ typedef struct file_vector {
 
 void fileVectorInit(file_vector* p);
 
-void fileVectorAppend(file_vector* p, const file_entry* ent);
+// return 1 when success, else return 0 (failed to alloc memory)
+int fileVectorAppend(file_vector* p, const file_entry* ent);
 
 void fileVectorDestroy(file_vector* p);
 
@@ -99,101 +175,415 @@ void formatNameToNormal(const BYTE* FAT_name, char* buffer);
 // return 1 in case success, else return 0
 void formatNameToFATType(const char* name, BYTE* buffer);
 
-// ----------- a simple completement of tree -----------
+// ----------- a flattened tree of entries -----------
 
 typedef struct ent_tree_node {
     file_entry ent;
-    void* sub_tree;
+    // children of a node are contiguous in the tree
+    DWORD first_child;
+    DWORD child_count; // 0 for a file or an empty directory
 } ent_tree_node;
 
+// all nodes are held in one array in breadth-first order, and the first one is the directory itself
 typedef struct ent_tree {
     ent_tree_node* storage;
-    size_t max_size;
-    size_t size;
+    DWORD max_size;
+    DWORD size;
 } ent_tree;
 
 void entTreeInit(ent_tree* p);
 
-void entTreeAppend(ent_tree* p, const file_entry* ent, void* sub_tree);
+// append a node without children, return 1 when success, else return 0 (failed to alloc memory)
+int entTreeAppend(ent_tree* p, const file_entry* ent);
 
-// use to sort
-int entTreeNodeCmp(const void* x, const void* y);
+// make room for `size` nodes, so that appending them would not grow the tree again
+// return 1 when success, else return 0 (failed to alloc memory)
+int entTreeReserve(ent_tree* p, DWORD size);
 
+// free the whole tree at once
 void entTreeDestroy(ent_tree* p);
 
 // ----------- ----------------------------- -----------
 
-// the pointer returned by this function should be destroyed by function `entTreeDestroy`
-ent_tree* getEntTree(const floppy* disk, WORD dir_clus_num);
+// ----------- scanning entries of directory -----------
+
+// the most number of entries scanned at once
+# define SCAN_MAX_ENTRIES 32
+
+// bit i of each mask is for the ith entry scanned, entries after the end of directory are in none of them
+typedef struct ent_scan_mask {
+    DWORD live; // neither empty nor deleted
+    DWORD deleted;
+    DWORD end; // the first empty entry, which is the end of directory
+    DWORD dir; // live ones with `FILE_ATTR_DIR`
+    DWORD vollab; // live ones with `FILE_ATTR_VOLLAB`
+    DWORD match; // live ones whose name is the one given
+} ent_scan_mask;
+
+// scan `count` (no more than `SCAN_MAX_ENTRIES`) entries at once
+// `name` is the 11-byte FAT name to match, or NULL if `match` is not needed
+void scanEntries(const file_entry* ents, int count, const BYTE* name, ent_scan_mask* mask);
+
+// position when walking through a directory, which is at most `SCAN_MAX_ENTRIES` entries per step
+typedef struct dir_iter {
+    WORD dir_clus_num;
+    WORD clus_num; // cluster of the next step (not used by root)
+    WORD logic_sec_num; // sector of the next step
+    WORD sec_in_clus; // index of `logic_sec_num` in the cluster
+    WORD slot; // index of the first entry of the next step in the sector
+    DWORD ent_num; // index of the first entry of the next step in the directory
+    int done;
+    file_entry buf[SCAN_MAX_ENTRIES]; // entries copied out of a snapshot
+} dir_iter;
+
+void dirIterInit(const volume* vol, dir_iter* it, WORD dir_clus_num);
+
+// return entries of the next step in the image, and set `*count` as number of them
+// `*loc` is set as location of the first one, `*clus_num` is set as cluster of them (if not NULL)
+// return NULL when there are no more entries
+const file_entry* dirIterNext(const volume* vol, dir_iter* it, int* count, ent_loc* loc, WORD* clus_num);
+
+// if the entry is "." or ".."
+# define entIsDotOrDotDot(ent) \
+    (!memcmp((ent)->DIR_Name, ".          ", 11) || !memcmp((ent)->DIR_Name, "..         ", 11))
+
+// ----------- ------------------------------ -----------
+
+// ----------- walking a directory tree in parallel -----------
+
+// at most this number of threads walk a tree, including the caller
+# define WALK_MAX_WORKERS 8
+// a tree is walked by threads only when this number of directories are waiting to be walked,
+// as starting them costs more than walking a small tree alone
+# define WALK_PARALLEL_MIN_DIRS 64
+
+// a directory visited by `walkDirTrees`
+typedef struct walk_dir {
+    file_entry ent;
+    // live entries in the directory except volume label, "." and ".."
+    file_entry* children;
+    DWORD child_count;
+    // visits of the directories in `children`, in the same order
+    // in a broken image a directory reached more than once has one visit, shared by all of them
+    struct walk_dir** subdirs;
+    DWORD subdir_count;
+} walk_dir;
+
+// result of a walk, whose memory is taken from blocks of each thread and freed at once
+typedef struct dir_walk {
+    walk_dir* tops; // visits of the directories given, in the same order
+    DWORD top_count;
+    DWORD dir_count; // including the tops
+    DWORD ent_count; // entries in all directories
+    struct walk_block* blocks[WALK_MAX_WORKERS];
+} dir_walk;
+
+// number of CPUs the process may run on, which is at least 1
+int usableCpuCount(void);
+
+// number of threads which could walk a tree at once, which is 1 if there is only one CPU to use
+int walkWorkerCount(void);
+
+// visit the directories and everything in them, each directory is a task run by one of a few threads,
+// which steal tasks from each other once their own run out. the result is the same no matter which thread visits which
+// the volume should not be changed while walking, so the caller should hold the namespace lock
+// exclusively or walk the view of a snapshot. return 1 when success, else return 0 (failed to alloc memory)
+int walkDirTrees(const volume* vol, const file_entry* tops, DWORD top_count, dir_walk* walk);
+
+void dirWalkDestroy(dir_walk* walk);
+
+// ----------- ------------------------------------ -----------
+
+// ----------- locks of a volume -----------
+
+void initVolumeLocks(volume* vol);
+
+void destroyVolumeLocks(volume* vol);
+
+void lockVolumeShared(const volume* vol);
+
+void lockVolumeExclusive(const volume* vol);
+
+void unlockVolume(const volume* vol);
+
+// directories to lock by an operation, each of them is locked once even if it is added twice
+typedef struct dir_lock_set {
+    WORD    stripes[4]; // index in `dir_locks`
+    int     write[4];
+    int     count;
+} dir_lock_set;
+
+void dirLockSetInit(dir_lock_set* set);
 
-void printEntTree(const ent_tree* p, const char* indent, int indent_len);
+// add a directory to lock for read or write, at most 4 directories could be added
+void dirLockSetAdd(dir_lock_set* set, WORD dir_clus_num, int write);
 
-// this is used for return search result in `getFileEntWithClusInfo`
-typedef struct ent_clus {
-    BYTE* clus_buf;
-    WORD logic_sec_num; // head logic sector number of cluster
-    int sec_per_clus;
-    file_entry* ent; // this pointer points to a specific position of `clus_buf`
-} ent_clus;
+// lock the directories in the set by ascending index, which is the order of locking
+void lockDirs(const volume* vol, dir_lock_set* set);
 
-void destroyEntClusInfo(ent_clus* p);
+void unlockDirs(const volume* vol, const dir_lock_set* set);
 
-// get file entry with cluster buffer and infomation, return NULL when not found
-// the pointer returned (except NULL) should be destroyed by `destroyEntClusInfo`
-ent_clus* getFileEntWithClusInfoByName(const floppy* disk, WORD dir_clus_num, const char* name);
+// lock only one directory
+void lockDir(const volume* vol, WORD dir_clus_num, int write);
+
+void unlockDir(const volume* vol, WORD dir_clus_num);
+
+// lock `FAT` and free extents, it is the last lock to take
+void lockAlloc(const volume* vol);
+
+void unlockAlloc(const volume* vol);
+
+// ----------- ---------------------- -----------
+
+// ----------- snapshots of a volume -----------
+
+// a read-only view of a volume as it was when the snapshot was opened, which later changes do not affect
+// reading the view takes no lock, so that a long reader never blocks writers of the volume
+// only functions reading through `dirIterNext`, `getNextClusNumFromFAT` and `readFileContentByEnt`,
+// such as `getEntTree` and `printDirTreeByClus`, could be used with the view. Names are found by walking
+// the directory, as the view has no index, so it is kept for readers which should see the volume at one
+// moment, such as export, while others like the tree read the listings of the volume under its locks
+typedef struct snapshot {
+    volume  view;
+} snapshot;
+
+// open a snapshot after operations in progress finish, return 1 when success, else return 0
+int openSnapshot(const volume* vol, snapshot* snap);
+
+void closeSnapshot(snapshot* snap);
+
+// ----------- -------------------- -----------
+
+// ----------- a simple completement of hash index of names -----------
+
+# define DIR_INDEX_EMPTY 0
+# define DIR_INDEX_USED 1
+# define DIR_INDEX_DELETED 2
+
+typedef struct dir_index_slot {
+    BYTE name[11];
+    BYTE state;
+    ent_loc loc;
+} dir_index_slot;
+
+// open addressing hash table from 11-byte FAT names to entry locations
+// with free slots of the directory, so that appending needs no scanning
+typedef struct dir_index {
+    dir_index_slot* storage;
+    DWORD capacity; // always a power of 2
+    DWORD size;
+    DWORD deleted; // number of slots in state `DIR_INDEX_DELETED`
+
+    // locations of deleted entries as a min-heap by `ent_num`, the first one is reused first
+    ent_loc* free_slots;
+    DWORD free_slot_count;
+    DWORD free_slot_max;
+    // the first never used entry, after which all entries are never used
+    ent_loc end;
+    // 0 if all entries in clusters of the directory have been used, and `end` is meaningless
+    int has_end;
+    // cluster `end` is in, or the last cluster when `has_end` is 0 (not used by root)
+    WORD end_clus_num;
+
+    // locations of live entries in the order of `fileEntCmp`, NULL until the directory is listed
+    ent_loc* listing;
+    DWORD listing_count;
+    DWORD listing_max;
+} dir_index;
+
+// return 1 when success, else return 0
+int dirIndexInit(dir_index* p);
+
+// return 1 when inserted, return 0 if the name exists already (the old location is kept)
+// return -1 if failed to alloc memory, and the name is not inserted
+int dirIndexInsert(dir_index* p, const BYTE* name, ent_loc loc);
 
-// get file entry by name in specified directory, return pointer to a copy of the file entry
 // return NULL when not found
-// the pointer (except NULL) returned should be detroyed by `free` or a memory leak problem occurred
-file_entry* getFileEntByName(const floppy* disk, WORD dir_clus_num, const char* name);
+const ent_loc* dirIndexFind(const dir_index* p, const BYTE* name);
+
+void dirIndexErase(dir_index* p, const BYTE* name);
+
+// return 1 when success, else return 0 (failed to alloc memory)
+int dirIndexPushFreeSlot(dir_index* p, ent_loc loc);
 
-// get file entry with cluster buffer and infomation, return NULL when not found
-// the pointer returned (except NULL) should be destroyed by `destroyEntClusInfo`
-ent_clus* getFileEntWithClusInfoByPath(const floppy* disk, WORD dir_clus_num, const char* path);
+// return the free slot with the least `ent_num`, assume there is at least one
+ent_loc dirIndexPopFreeSlot(dir_index* p);
 
-// get file entry by path, return pointer to a copy of the file entry, return NULL when not found
-// the pointer (except NULL) returned should be detroyed by `free` or a memory leak problem occurred
-file_entry* getFileEntByPath(const floppy* disk, WORD dir_clus_num, const char* path);
+void dirIndexDestroy(dir_index* p);
+
+// ----------- ------------------------------------------ -----------
+
+// return index of the directory, which is built by scanning the directory on first access
+// return NULL if `dir_clus_num` is not a legal directory cluster, or memory can not be allocated
+dir_index* getDirIndex(const volume* vol, WORD dir_clus_num);
+
+// drop index of the directory (if built), called when the directory is removed
+void dropDirIndex(const volume* vol, WORD dir_clus_num);
+
+// remove the entry at `loc` from index of the directory (if built), and its slot becomes free
+void unindexEntInDir(volume* vol, WORD dir_clus_num, const BYTE* name, ent_loc loc);
+
+// return locations of live entries of the directory in the order of `fileEntCmp`, and the number in `count`
+// the list is sorted once and then kept up to date, return NULL if not a legal directory or failed to alloc memory
+const ent_loc* getDirListing(const volume* vol, WORD dir_clus_num, DWORD* count);
+
+// build the tree of everything in the directory in one breadth-first walk, large trees are walked by threads
+// a directory reached again in a broken image is left out, so the tree is always finite
+// return 1 when success, and the tree should be destroyed by function `entTreeDestroy`
+// else return 0 (failed to alloc memory), and there is nothing to destroy
+int getEntTree(const volume* vol, WORD dir_clus_num, ent_tree* tree);
+
+// copy live entries of the directory except volumn label, "." and ".." in the order of `fileEntCmp`
+// from the listing of the volume, or by walking the view of a snapshot. return 1 when success, else return 0
+// the vector should be destroyed by function `fileVectorDestroy` in both cases
+int getDirChildren(const volume* vol, WORD dir_clus_num, file_vector* children);
+
+// print everything in the directory as a tree, in the same order as the listing of each directory
+// a directory reached again in a broken image is printed by name but not walked twice
+void printDirTreeByClus(FILE* out, const volume* vol, WORD dir_clus_num, const char* indent, int indent_len);
+
+// this is used for return search result in `getFileEntRefByName` and `getFileEntRefByPath`
+// all content is held by value, so there is nothing to free
+typedef struct ent_ref {
+    file_entry ent; // a copy of the entry
+    WORD dir_clus_num; // directory the entry is in
+    ent_loc loc; // where the entry is, `logic_sec_num` is 0 for root which has no entry
+} ent_ref;
+
+// entry at the location, which points into the image
+# define entAtLoc(vol, loc) \
+    ((file_entry*)((vol)->disk->storage + logicSecToOffset(vol, (loc).logic_sec_num)) + (loc).slot)
+
+// overwrite the entry at the location in the image
+void writeEntAtLoc(volume* vol, ent_loc loc, const file_entry* ent);
+
+// mark the entry as deleted, both in the image and in index of its directory
+void deleteEntByRef(volume* vol, const ent_ref* ref);
+
+// find the entry by name in specified directory, return 1 when found, else return 0
+// lookups by name expect the lock of the directory to be held by the caller
+int getFileEntRefByName(const volume* vol, WORD dir_clus_num, const char* name, ent_ref* ref);
+
+// the same as `getFileEntRefByName`, but the name is in FAT format
+int getFileEntRefByFATName(const volume* vol, WORD dir_clus_num, const BYTE* name, ent_ref* ref);
+
+// get a copy of file entry by name in specified directory, return 1 when found, else return 0
+int getFileEntByName(const volume* vol, WORD dir_clus_num, const char* name, file_entry* ent);
+
+// find the entry by the first `len` characters of path, return 1 when found, else return 0
+// lookups by path lock each directory on the path while looking in it, so the caller should hold no directory lock
+int getFileEntRefByPathLen(const volume* vol, WORD dir_clus_num, const char* path, int len, ent_ref* ref);
+
+// find the entry by path, return 1 when found, else return 0
+int getFileEntRefByPath(const volume* vol, WORD dir_clus_num, const char* path, ent_ref* ref);
+
+// get a copy of file entry by path, return 1 when found, else return 0
+int getFileEntByPath(const volume* vol, WORD dir_clus_num, const char* path, file_entry* ent);
 
 // simplify a absolute direcotry path stirng
 void simplifyAbsolutePathString(char* path);
 
 // read file content to buffer, return number of cluters loaded
 // return 0 is the file size doesn't match FAT record
-int readFileContentByEnt(const floppy* disk, const file_entry* ent, BYTE* buf);
+int readFileContentByEnt(const volume* vol, const file_entry* ent, BYTE* buf);
+
+// open the file of the entry at its head for read, return 1 when success
+// return 0 if the file size doesn't match FAT record, or failed to alloc memory
+int openFileByEnt(const volume* vol, const file_entry* ent, file_handle* fh);
+
+// number of clusters in the chain of the opened file
+# define fileClusTotal(fh) \
+    ((fh)->extent_count ? (fh)->extents[(fh)->extent_count - 1].file_clus \
+        + (fh)->extents[(fh)->extent_count - 1].len : 0)
+
+// make room for at least `count` extents in the map, return 1 when success, else return 0
+int reserveFileExtents(file_handle* fh, int count);
+
+// add the cluster to the end of the extent map, merging it into the last extent if possible
+// return 1 when success, else return 0 (failed to alloc memory) and the map is not changed
+int appendFileExtent(file_handle* fh, WORD clus_num);
+
+// index of the extent holding cluster `file_clus` of the file, or the last one if it is beyond the chain
+int findFileExtent(const file_handle* fh, DWORD file_clus);
+
+// image offset of byte `pos` of the opened file and number of continuous bytes there (at most `len`)
+// move to the next extent if `pos` is at the end of current one, assume `pos` is in the chain
+size_t fileSpanAtPos(file_handle* fh, size_t len, size_t* offset);
+
+// allocations of no more than this number of clusters use next-fit instead of best-fit
+# define SMALL_ALLOC_CLUS_COUNT 4
+
+// build `vol->free_extents` from the decoded FAT, return 1 when success, else return 0
+int buildFreeExtents(volume* vol);
+
+// return index of the first free extent whose start is not less than `clus_num`
+int lowerBoundFreeExtent(const volume* vol, WORD clus_num);
+
+// take at most `count` clusters from the head of the `index`th free extent
+// return number of clusters taken, and the taken run starts at `*start`
+WORD takeFromFreeExtent(volume* vol, int index, WORD count, WORD* start);
+
+// put a run of clusters back to free extents, merging it with its neighbours
+void releaseFreeRun(volume* vol, WORD start, WORD len);
+
+// put runs of clusters back to free extents at once, sorting `runs` and merging it in one pass
+// the caller of it and `cutFATChain` should hold `alloc_lock`
+void releaseFreeRuns(volume* vol, free_extent* runs, int count);
+
+// clear FAT entries of the chain, and append runs of consecutive clusters in it to `runs`
+// a run right after the last one in `runs` is merged into it, so chains allocated in order collapse
+void cutFATChain(volume* vol, WORD head_clus_num, free_extent* runs, int* run_count);
+
+// alloc `count` number of data clusters in FAT record without cleaning them up
+// the last allocated cluster is returned in `tail_clus` if it is not NULL
+// allocating and freeing functions below take `alloc_lock` themselves
+WORD allocFATChain(volume* vol, unsigned int count, WORD pre_clus, WORD* tail_clus);
+
+// fill bytes [from, bytes_per_clus) of the cluster with 0
+void zeroClusTail(volume* vol, WORD clus_num, DWORD from);
 
 // alloc `count` number of data clusters in FAT record
 // if the `pre` parameter is not 0, FAT[pre] would be changed to the first allocated cluster
 // no matter `pre` is 0 or not, return the number of the first allocated cluster
 // if allocating failed, return 0
-WORD allocFATClus(floppy* disk, unsigned int count, WORD pre_clus);
+WORD allocFATClus(volume* vol, unsigned int count, WORD pre_clus);
+
+// alloc clusters to hold `bytes` bytes, which would all be written by the caller from head of the chain
+// so only the rest of the last cluster is filled with 0, which saves cleaning up clusters of files
+// directories should still use `allocFATClus`, as their end is marked by a clean entry
+WORD allocFATClusForWrite(volume* vol, DWORD bytes, WORD pre_clus);
 
-void freeFATClus(floppy* disk, WORD head_clus_num);
+void freeFATClus(volume* vol, WORD head_clus_num);
 
 // append the entry in specific directory. Return 1 when succeed, else return 0
 // whoever use this function has the duty to ensure the entry is legal
-int appendEntInDir(floppy* disk, WORD dir_clus_num, const file_entry* ent_to_append);
+int appendEntInDir(volume* vol, WORD dir_clus_num, const file_entry* ent_to_append);
 
 // write file content in buffer to disk according to file entry, return number of clusters written
 // assume the file entry has already been set with correct head cluster and file size
+// and the chain is allocated by `allocFATClusForWrite`, so that the rest of last cluster is clean
 // return 0 if file size doesn't match FAT record, but content written would not be recover
-int writeFileContentByEnt(floppy* disk, const file_entry* ent, const BYTE* buf);
+int writeFileContentByEnt(volume* vol, const file_entry* ent, const BYTE* buf);
+
+// copy content of the file to the chain headed by `des_head_clus_num`, which should be long enough
+// run by run inside the image, the chain should be allocated by `allocFATClusForWrite`
+// return number of clusters copied, or 0 if the file size doesn't match FAT record
+int copyFileContentByEnt(volume* vol, const file_entry* src_ent, WORD des_head_clus_num);
+
+// return head cluster number of parent of the directory, which is 0 for root
+WORD getParentDirClusNum(const volume* vol, WORD dir_clus_num);
 
 // judge if dir A is parent of dir B
-int isParent(const floppy* disk, WORD A_clus_num, WORD B_clus_num);
-
-// remove all file (include directory, recursively) in directory
-// this function is not applicable to root
-void removeAllInDir(floppy* disk, WORD dir_clus_num);
-
-// return 1 when succeed else return 0
-// for convenience this is a completement with low efficiency
-int copyDirInternalRecursion(floppy* disk,
-    const directory* dir,
-    const char* src,
-    int src_len,
-    const char* des,
-    int des_len,
-    const ent_tree* tree);
+int isParent(const volume* vol, WORD A_clus_num, WORD B_clus_num);
+
+// free the directory and everything in it recursively in one batch, entry of the directory is not changed
+// this function is not applicable to root. return 1 when succeed, else return 0 and nothing is changed
+int removeDirTree(volume* vol, WORD dir_clus_num);
+
+// copy the source directory and everything in it as a new directory in `des_dir_clus_num`
+// `newdir` is the entry of the new directory, whose head cluster is set here
+// every cluster needed is allocated at once, and entries of new directories are written in bulk
+// return 1 when succeed, else return 0 and nothing is changed
+int copyDirTree(volume* vol, WORD src_dir_clus_num, WORD des_dir_clus_num, file_entry* newdir);
 
 # endif
\ No newline at end of file
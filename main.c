@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "fat12.h"
 
+// size of the output buffer in script mode, which is flushed when it fills or at the end
+#define SCRIPT_OUT_BUFFER_SIZE (1 << 20)
+
 void printHelpInfo() {
     printf("info        -- print FAT12 header infomation of the disk.\n");
     printf("bootable    -- check if the floppy is bootable. (by verifying 0x55AA)\n");
@@ -17,109 +21,318 @@ void printHelpInfo() {
     printf("rmdir {dir} -- delete directory {dir} (include file and sub-directory in it)\n");
     printf("cpdir {src} {des}-- copy from {src} directory to {des} directory (recursive)\n");
     printf("concat {1} {2} {des}-- concat content of file {1} and {2} to {des} file.\n");
+    printf("append {src} {des}-- append content of {src} file to the end of {des} file.\n");
+    printf("truncate {file} {size}-- cut {file} to {size} bytes.\n");
     printf("quit        -- quit and save all changed.\n");
 }
 
-int main() {
-    printf("Input file name: ");
+void printUsage() {
+    printf("usage: fat12_demo [-r] [-k] [-c commands | -f file] [image]\n");
+    printf("  -r           -- open the image read-only, shared with other processes.\n");
+    printf("  -c commands  -- run {commands} without prompts, instead of reading them from input.\n");
+    printf("  -f file      -- run commands in {file} (\"-\" for stdin) without prompts.\n");
+    printf("  -k           -- go on with the script after a command fails.\n");
+    printf("in a script, commands are ended by line breaks or \";\", a word may be quoted by \"\" or ''\n");
+    printf("and \"#\" starts a comment. The script stops at the first failed command (unless -k),\n");
+    printf("changes are written back once it ends, and the exit code is 1 if any command failed.\n");
+}
+
+static const struct {
+    const char* name;
+    int argc;
+} command_table[] = {
+    { "help", 0 }, { "bootable", 0 }, { "info", 0 }, { "ls", 0 }, { "cd", 1 }, { "type", 1 },
+    { "tree", 0 }, { "cp", 2 }, { "mv", 2 }, { "rm", 1 }, { "mkdir", 1 }, { "rmdir", 1 },
+    { "cpdir", 2 }, { "concat", 3 }, { "append", 2 }, { "truncate", 2 }, { "quit", 0 },
+};
+
+// number of arguments the command takes, or -1 if it is unknown
+static int commandArgc(const char* name) {
+    for (int i = 0; i < (int)(sizeof(command_table) / sizeof(command_table[0])); ++i) {
+        if (!strcmp(name, command_table[i].name)) return command_table[i].argc;
+    }
+    return -1;
+}
+
+// run a known command other than "quit" with its arguments in `args`
+// return 1 when success, else print why and return 0
+static int runCommand(floppy* disk, volume* vol, directory* dir, const char* command, char** args) {
+    if (!strcmp(command, "help")) {
+        printHelpInfo();
+    } else if (!strcmp(command, "bootable")) {
+        if (verifyBootId(disk)) {
+            printf("This image is bootable.\n");
+        } else {
+            printf("This image is NOT bootable.\n");
+        }
+    } else if (!strcmp(command, "info")) {
+        printFat12Info(disk);
+    } else if (!strcmp(command, "ls")) {
+        printAllInDir(vol, dir);
+    } else if (!strcmp(command, "cd")) {
+        if (!changeDirectory(vol, dir, args[0])) {
+            printf("Failed to change directory into \"%s\"\n", args[0]);
+            return 0;
+        }
+    } else if (!strcmp(command, "type")) {
+        if (!printFileContentByPath(vol, dir, args[0])) {
+            printf("Failed to read content of file \"%s\"\n", args[0]);
+            return 0;
+        }
+    } else if (!strcmp(command, "tree")) {
+        printDirTree(vol, dir);
+    } else if (!strcmp(command, "cp")) {
+        if (!copyFileByPath(vol, dir, args[0], args[1])) {
+            printf("Failed to copy file from \"%s\" to \"%s\"\n", args[0], args[1]);
+            return 0;
+        }
+    } else if (!strcmp(command, "mv")) {
+        if (!moveFileByPath(vol, dir, args[0], args[1])) {
+            printf("Failed to move file from \"%s\" to \"%s\"\n", args[0], args[1]);
+            return 0;
+        }
+    } else if (!strcmp(command, "rm")) {
+        if (!removeFileByPath(vol, dir, args[0])) {
+            printf("Failed to remove file \"%s\"\n", args[0]);
+            return 0;
+        }
+    } else if (!strcmp(command, "mkdir")) {
+        if (!makeDirByPath(vol, dir, args[0])) {
+            printf("Failed to make directory \"%s\"\n", args[0]);
+            return 0;
+        }
+    } else if (!strcmp(command, "rmdir")) {
+        if (!removeDirByPath(vol, dir, args[0])) {
+            printf("Failed to remove directory \"%s\"\n", args[0]);
+            return 0;
+        }
+    } else if (!strcmp(command, "cpdir")) {
+        if (!copyDirByPath(vol, dir, args[0], args[1])) {
+            printf("Failed to copy directory \"%s\" to \"%s\"\n", args[0], args[1]);
+            return 0;
+        }
+    } else if (!strcmp(command, "concat")) {
+        if (!concatFileByPath(vol, dir, args[0], args[1], args[2])) {
+            printf("Failed to concat \"%s\" and \"%s\" to \"%s\"\n", args[0], args[1], args[2]);
+            return 0;
+        }
+    } else if (!strcmp(command, "append")) {
+        if (!appendFileByPath(vol, dir, args[0], args[1])) {
+            printf("Failed to append \"%s\" to \"%s\"\n", args[0], args[1]);
+            return 0;
+        }
+    } else if (!strcmp(command, "truncate")) {
+        char* end;
+        unsigned int size = (unsigned int)strtoul(args[1], &end, 10);
+        if (*end != '\0' || !truncateFileByPath(vol, dir, args[0], size)) {
+            printf("Failed to truncate file \"%s\" to %s bytes\n", args[0], args[1]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// split the next command off the script into `words` (at most `max_words` are kept), which point into `buf`
+// commands are ended by line breaks or ';', words are separated by spaces, and a word may be quoted
+// by '' or "" (in which \" and \\ are escaped), `buf` should be as long as the rest of the script
+// return number of words (0 for an empty command), or -1 for an unterminated quote. `*pos` is moved after it
+static int nextScriptCommand(const char** pos, char* buf, char** words, int max_words) {
+    const char* p = *pos;
+    char* q = buf;
+    int count = 0;
+    while (1) {
+        while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+        if (*p == '\0') break;
+        if (*p == '\n' || *p == ';') {
+            ++p;
+            break;
+        }
+        if (*p == '#') {
+            // comment to the end of line
+            while (*p && *p != '\n') ++p;
+            continue;
+        }
+        if (count < max_words) words[count] = q;
+        ++count;
+        while (*p && !strchr(" \t\r\n;", *p)) {
+            if (*p == '\'' || *p == '"') {
+                char quote = *p++;
+                while (*p && *p != quote) {
+                    if (quote == '"' && *p == '\\' && (p[1] == '"' || p[1] == '\\')) ++p;
+                    *q++ = *p++;
+                }
+                if (*p == '\0') {
+                    *pos = p;
+                    return -1;
+                }
+                ++p;
+            } else {
+                *q++ = *p++;
+            }
+        }
+        *q++ = '\0';
+    }
+    *pos = p;
+    return count;
+}
+
+// run commands of the script in order, return number of failed ones
+static int runScript(floppy* disk, volume* vol, directory* dir, const char* script, int keep_going) {
+    char* buf = (char*)malloc(strlen(script) + 1);
+    char* words[4];
+    int failed = 0;
+    const char* pos = script;
+    while (*pos && (!failed || keep_going)) {
+        int count = nextScriptCommand(&pos, buf, words, 4);
+        if (count == 0) continue;
+        if (count < 0) {
+            printf("Unterminated quote in script\n");
+            ++failed;
+            break;
+        }
+        int argc = commandArgc(words[0]);
+        if (argc < 0) {
+            printf("Unkown command: %s\n", words[0]);
+            ++failed;
+        } else if (argc != count - 1) {
+            printf("Command \"%s\" takes %d arguments\n", words[0], argc);
+            ++failed;
+        } else if (!strcmp(words[0], "quit")) {
+            break;
+        } else if (!runCommand(disk, vol, dir, words[0], words + 1)) {
+            ++failed;
+        }
+    }
+    free(buf);
+    return failed;
+}
+
+// read the whole file (stdin for "-") as a string, return NULL if it can not be read
+static char* readScriptFile(const char* file_name) {
+    FILE* fp = strcmp(file_name, "-") ? fopen(file_name, "rb") : stdin;
+    if (!fp) return NULL;
+    size_t len = 0, max_len = 4096;
+    char* script = (char*)malloc(max_len);
+    size_t n;
+    while ((n = fread(script + len, 1, max_len - len - 1, fp)) > 0) {
+        len += n;
+        if (max_len - len == 1) {
+            max_len *= 2;
+            script = (char*)realloc(script, max_len);
+        }
+    }
+    script[len] = '\0';
+    if (fp != stdin) fclose(fp);
+    return script;
+}
+
+int main(int argc, char** argv) {
+    // with "-r" the image is opened read-only and shared with other processes
+    int read_only = 0;
+    int keep_going = 0;
+    char* script = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "rkc:f:h")) != -1) {
+        if (opt == 'r') {
+            read_only = 1;
+        } else if (opt == 'k') {
+            keep_going = 1;
+        } else if (opt == 'c' && !script) {
+            script = strdup(optarg);
+        } else if (opt == 'f' && !script) {
+            script = readScriptFile(optarg);
+            if (!script) {
+                printf("Failed to read script from file \"%s\"\n", optarg);
+                return 1;
+            }
+        } else {
+            printUsage();
+            free(script);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
     char name[256];
-    scanf("%s", name);
+    if (optind < argc) {
+        snprintf(name, sizeof(name), "%s", argv[optind]);
+    } else if (script) {
+        printUsage();
+        free(script);
+        return 1;
+    } else {
+        printf("Input file name: ");
+        if (scanf("%255s", name) != 1) return 1;
+    }
+    int scripted = (script != NULL);
+    if (scripted) {
+        // output is only flushed when the buffer fills or at the end
+        static char out_buffer[SCRIPT_OUT_BUFFER_SIZE];
+        setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    }
 
     floppy* disk = (floppy*)malloc(sizeof(floppy));
-    if (!readFloppyDisk(name, disk)) {
+    if (!mapFloppyDisk(name, disk, read_only)) {
         printf("Failed to read image from file.\n");
+        destroyFloppyDisk(disk);
         free(disk);
+        free(script);
+        return 1;
+    }
+    volume vol;
+    if (!mountVolume(&vol, disk)) {
+        printf("Failed to mount FAT12 file system of the image.\n");
+        unmountVolume(&vol);
+        destroyFloppyDisk(disk);
+        free(disk);
+        free(script);
         return 1;
     }
 
     directory dir;
     initDirWithRoot(&dir);
 
-    char* buffer = (char*)malloc(1024);
-    char* const command = buffer;
-    char* const path = buffer + 256;
-    char* const path2 = buffer + 256 * 2;
-    char* const path3 = buffer + 256 * 3;
-    int changed = 0; // if the disk is written
-    printf("Input \"help\" to get help infomation.\n");
-    while (1) {
-        printf("[%s]$ ", dir.path_str);
-        scanf("%s", command);
-        if (!strcmp(command, "help")) {
-            printHelpInfo();
-        } else if (!strcmp(command, "bootable")) {
-            if (verifyBootId(disk)) {
-                printf("This image is bootable.\n");
-            } else {
-                printf("This image is NOT bootable.\n");
-            }
-        } else if (!strcmp(command, "info")) {
-            printFat12Info(disk);
-        } else if (!strcmp(command, "ls")) {
-            printAllInDir(disk, &dir);
-        } else if (!strcmp(command, "cd")) {
-            scanf("%s", path);
-            if (!changeDirectory(disk, &dir, path)) {
-                printf("Failed to change directory into \"%s\"\n", path);
+    int failed = 0;
+    if (scripted) {
+        failed = runScript(disk, &vol, &dir, script, keep_going);
+        free(script);
+    } else {
+        char* buffer = (char*)malloc(1024);
+        char* const command = buffer;
+        char* args[3] = { buffer + 256, buffer + 256 * 2, buffer + 256 * 3 };
+        printf("Input \"help\" to get help infomation.\n");
+        while (1) {
+            printf("[%s]$ ", dir.path_str);
+            if (scanf("%255s", command) != 1) break;
+            int command_argc = commandArgc(command);
+            if (command_argc < 0) {
+                printf("Unkown command: %s\n", command);
+                continue;
             }
-        } else if (!strcmp(command, "type")) {
-            scanf("%s", path);
-            if (!printFileContentByPath(disk, &dir, path)) {
-                printf("Failed to read content of file \"%s\"\n", path);
-            }
-        } else if (!strcmp(command, "tree")) {
-            printDirTree(disk, &dir);
-        } else if (!strcmp(command, "cp")) {
-            scanf("%s %s", path, path2);
-            if (!copyFileByPath(disk, &dir, path, path2)) {
-                printf("Failed to copy file from \"%s\" to \"%s\"\n", path, path2);
-            } else changed = 1;
-        } else if (!strcmp(command, "mv")) {
-            scanf("%s %s", path, path2);
-            if (!moveFileByPath(disk, &dir, path, path2)) {
-                printf("Failed to move file from \"%s\" to \"%s\"\n", path, path2);
-            } else changed = 1;
-        } else if (!strcmp(command, "rm")) {
-            scanf("%s", path);
-            if (!removeFileByPath(disk, &dir, path)) {
-                printf("Failed to remove file \"%s\"\n", path);
-            } else changed = 1;
-        } else if (!strcmp(command, "mkdir")) {
-            scanf("%s", path);
-            if (!makeDirByPath(disk, &dir, path)) {
-                printf("Failed to make directory \"%s\"\n", path);
-            } else changed = 1;
-        } else if (!strcmp(command, "rmdir")) {
-            scanf("%s", path);
-            if (!removeDirByPath(disk, &dir, path)) {
-                printf("Failed to remove directory \"%s\"\n", path);
-            } else changed = 1;
-        } else if (!strcmp(command, "cpdir")) {
-            scanf("%s %s", path, path2);
-            if (!copyDirByPath(disk, &dir, path, path2)) {
-                printf("Failed to copy directory \"%s\" to \"%s\"\n", path, path2);
-            } else changed = 1;
-        } else if (!strcmp(command, "concat")) {
-            scanf("%s %s %s", path, path2, path3);
-            if (!concatFileByPath(disk, &dir, path, path2, path3)) {
-                printf("Failed to concat \"%s\" and \"%s\" to \"%s\"\n", path, path2, path3);
-            } else changed = 1;
-        } else if (!strcmp(command, "quit")) {
-            break;
-        } else {
-            printf("Unkown command: %s\n", command);
+            if (!strcmp(command, "quit")) break;
+            for (int i = 0; i < command_argc; ++i) scanf("%255s", args[i]);
+            runCommand(disk, &vol, &dir, command, args);
         }
+        free(buffer);
     }
-    free(buffer);
     destroyDir(&dir);
-    if (changed) {
-        printf("Disk content has been changed.Trying to writing back...\n");
+    // the FAT and entries changed by all commands are in memory till now, and written back at once
+    int flushed = flushVolume(&vol);
+    unmountVolume(&vol);
+    if (!flushed) {
+        // entries written without the FAT would leave a broken image, so nothing is written back
+        printf("Failed to pack the FAT, the file is not written back.\n");
+        ++failed;
+    } else if (floppyDiskChanged(disk)) {
+        if (!scripted) printf("Disk content has been changed.Trying to writing back...\n");
         if (!writeFloppyDisk(name, disk)) {
             printf("Failed to write the file back.\n");
-        } else {
+            ++failed;
+        } else if (!scripted) {
             printf("Successfully write back.\n");
         }
     }
+    destroyFloppyDisk(disk);
     free(disk);
-    return 0;
-}
\ No newline at end of file
+    fflush(stdout);
+    return failed ? 1 : 0;
+}
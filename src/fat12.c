@@ -1,72 +1,235 @@
 # include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
+# include <errno.h>
 # include <time.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
 # include "fat12.h"
 # include "fat12_internal.h"
 
-// return 1 when success, else return 0
+// remember `fd` as the image file which has the same content as `disk->storage` now
+void setFloppyDiskSource(floppy* disk, int fd) {
+    struct stat st;
+    disk->has_source = (fstat(fd, &st) == 0);
+    if (disk->has_source) {
+        disk->source_dev = st.st_dev;
+        disk->source_ino = st.st_ino;
+    }
+    memset(disk->dirty_map, 0, sizeof(disk->dirty_map));
+}
+
+// read the whole image into memory, return 1 when success, else return 0
 int readFloppyDisk(const char* file_name, floppy* disk) {
+    disk->storage = NULL;
+    disk->mapped = 0;
+    disk->oldest_version = NULL;
+    disk->newest_version = NULL;
+    pthread_mutex_init(&disk->version_lock, NULL);
+    disk->read_only = 0;
     FILE* fp = fopen(file_name, "rb");
     if (!fp) return 0;
-    int read_size = fread(disk, sizeof(floppy), 1, fp);
+    disk->storage = (BYTE*)malloc(FLOPPY_SIZE);
+    if (!disk->storage) {
+        fclose(fp);
+        return 0;
+    }
+    int read_size = fread(disk->storage, FLOPPY_SIZE, 1, fp);
+    setFloppyDiskSource(disk, fileno(fp));
     fclose(fp);
     return read_size == 1;
 }
 
+// map the image file instead of reading it, so that only sectors used are loaded
+// a read-only image is shared with other processes, otherwise the mapping is private
+// and changes are saved by `writeFloppyDisk`. return 1 when success, else return 0
+int mapFloppyDisk(const char* file_name, floppy* disk, int read_only) {
+    disk->storage = NULL;
+    disk->mapped = 0;
+    disk->oldest_version = NULL;
+    disk->newest_version = NULL;
+    pthread_mutex_init(&disk->version_lock, NULL);
+    disk->read_only = read_only;
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < FLOPPY_SIZE) {
+        close(fd);
+        return 0;
+    }
+    void* addr = read_only
+        ? mmap(NULL, FLOPPY_SIZE, PROT_READ, MAP_SHARED, fd, 0)
+        : mmap(NULL, FLOPPY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    setFloppyDiskSource(disk, fd);
+    close(fd); // the mapping is still valid after closing
+    if (addr == MAP_FAILED) return 0;
+    disk->storage = (BYTE*)addr;
+    disk->mapped = 1;
+    return 1;
+}
+
 // return 1 when success, else return 0
-int writeFloppyDisk(const char* file_name, const floppy* disk) {
+// when writing to the same file the image was read from, only changed sectors are written
+int writeFloppyDisk(const char* file_name, floppy* disk) {
+    if (disk->read_only) return 0;
+    int fd = open(file_name, O_WRONLY);
+    if (fd >= 0 && disk->has_source) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_dev == disk->source_dev && st.st_ino == disk->source_ino) {
+            // the file has the same content as `storage` except dirty units, and bytes after the image are kept
+            // it is never truncated, as it may still be mapped as `storage`
+            int success = writeDirtyUnits(disk, fd);
+            close(fd);
+            return success;
+        }
+    }
+    if (fd >= 0) close(fd);
     FILE* fp = fopen(file_name, "wb");
     if (!fp) return 0;
-    int write_size = fwrite(disk, sizeof(floppy), 1, fp);
+    int write_size = fwrite(disk->storage, FLOPPY_SIZE, 1, fp);
+    if (fflush(fp) == 0 && write_size == 1) {
+        setFloppyDiskSource(disk, fileno(fp));
+    }
     fclose(fp);
     return write_size == 1;
 }
 
+// return 1 if the image has been changed since it was read or written, else return 0
+int floppyDiskChanged(const floppy* disk) {
+    for (size_t i = 0; i < sizeof(disk->dirty_map); ++i) {
+        if (disk->dirty_map[i]) return 1;
+    }
+    return 0;
+}
+
+// free memory allocated in `readFloppyDisk` or `mapFloppyDisk`
+void destroyFloppyDisk(floppy* disk) {
+    if (disk->mapped) {
+        munmap(disk->storage, FLOPPY_SIZE);
+    } else {
+        free(disk->storage);
+    }
+    disk->storage = NULL;
+    destroyFloppyVersions(disk);
+}
+
 // return 1 if the floppy disk is bootable, else return 0
 int verifyBootId(const floppy* disk) {
     const BYTE* s = disk->storage;
     return s[510] == 0x55 && s[511] == 0xAA;
 }
 
-void printFat12Info(const floppy* disk) {
+void fprintFat12Info(FILE* out, const floppy* disk) {
     // the start of floopy disk is exactly the header
     fat12_header* p = (fat12_header*)disk->storage;
 
     // calculate start address of boot program
     WORD jmp_addr = BOOT_START_ADDR + p->JmpCode[1] + 2;
-    printf("Boot start address: 0x%04x\n", jmp_addr);
+    fprintf(out, "Boot start address: 0x%04x\n", jmp_addr);
 
     char buffer[12];
 
     memcpy(buffer, p->BS_OEMName, 8);
     buffer[8] = '\0';
-    printf("BS_OEMName:         %s\n", buffer);
+    fprintf(out, "BS_OEMName:         %s\n", buffer);
     
-    printf("BPB_BytesPerSec:    %u\n", p->BPB_BytesPerSec);
-    printf("BPB_SecPerClus:     %u\n", p->BPB_SecPerClus);
-    printf("BPB_RsvdSecCnt:     %u\n", p->BPB_RsvdSecCnt);
-    printf("BPB_NumFATs:        %u\n", p->BPB_NumFATs);
-    printf("BPB_RootEntCnt:     %u\n", p->BPB_RootEntCnt);
-    printf("BPB_TotSec16:       %u\n", p->BPB_TotSec16);
-    printf("BPB_Media:          0x%02x\n", p->BPB_Media);
-    printf("BPB_FATSz16:        %u\n", p->BPB_FATSz16);
-    printf("BPB_SecPerTrk:      %u\n", p->BPB_SecPerTrk);
-    printf("BPB_NumHeads:       %u\n", p->BPB_NumHeads);
-    printf("BPB_HiddSec:        %u\n", p->BPB_HiddSec);
-    printf("BPB_TotSec32:       %u\n", p->BPB_TotSec32);
-    printf("BS_DrvNum:          %u\n", p->BS_DrvNum);
-    printf("BS_Reserved1:       %u\n", p->BS_Reserved1);
-    printf("BS_BootSig:         0x%02x\n", p->BS_BootSig);
-    printf("BS_VolID:           %u\n", p->BS_VolID);
+    fprintf(out, "BPB_BytesPerSec:    %u\n", p->BPB_BytesPerSec);
+    fprintf(out, "BPB_SecPerClus:     %u\n", p->BPB_SecPerClus);
+    fprintf(out, "BPB_RsvdSecCnt:     %u\n", p->BPB_RsvdSecCnt);
+    fprintf(out, "BPB_NumFATs:        %u\n", p->BPB_NumFATs);
+    fprintf(out, "BPB_RootEntCnt:     %u\n", p->BPB_RootEntCnt);
+    fprintf(out, "BPB_TotSec16:       %u\n", p->BPB_TotSec16);
+    fprintf(out, "BPB_Media:          0x%02x\n", p->BPB_Media);
+    fprintf(out, "BPB_FATSz16:        %u\n", p->BPB_FATSz16);
+    fprintf(out, "BPB_SecPerTrk:      %u\n", p->BPB_SecPerTrk);
+    fprintf(out, "BPB_NumHeads:       %u\n", p->BPB_NumHeads);
+    fprintf(out, "BPB_HiddSec:        %u\n", p->BPB_HiddSec);
+    fprintf(out, "BPB_TotSec32:       %u\n", p->BPB_TotSec32);
+    fprintf(out, "BS_DrvNum:          %u\n", p->BS_DrvNum);
+    fprintf(out, "BS_Reserved1:       %u\n", p->BS_Reserved1);
+    fprintf(out, "BS_BootSig:         0x%02x\n", p->BS_BootSig);
+    fprintf(out, "BS_VolID:           %u\n", p->BS_VolID);
 
     memcpy(buffer, p->BS_VolLab, 11);
     buffer[11] = '\0';
-    printf("BS_VolLab:          %s\n", buffer);
+    fprintf(out, "BS_VolLab:          %s\n", buffer);
 
     memcpy(buffer, p->BS_FileSysType, 8);
     buffer[8] = '\0';
-    printf("BS_FileSysType:     %s\n", buffer);
+    fprintf(out, "BS_FileSysType:     %s\n", buffer);
+}
+
+void printFat12Info(const floppy* disk) {
+    fprintFat12Info(stdout, disk);
+}
+
+// check the header and mount the file system on the floppy, return 1 when success, else return 0
+int mountVolume(volume* vol, floppy* disk) {
+    const fat12_header* const header = (const fat12_header* const)disk->storage;
+    initVolumeLocks(vol);
+    vol->disk = disk;
+    vol->FAT = NULL;
+    vol->free_extents = NULL;
+    vol->dir_indexes = NULL;
+    vol->version = NULL;
+    if (header->BPB_BytesPerSec == 0 || header->BPB_SecPerClus == 0 || header->BPB_FATSz16 == 0) {
+        return 0; // not a legal FAT12 header
+    }
+    vol->bytes_per_sec = header->BPB_BytesPerSec;
+    vol->sec_per_clus = header->BPB_SecPerClus;
+    vol->bytes_per_clus = vol->bytes_per_sec * vol->sec_per_clus;
+    vol->entries_per_clus = vol->bytes_per_clus / sizeof(file_entry);
+    vol->bytes_per_sec_shift = log2OfPowerOf2(vol->bytes_per_sec);
+    vol->sec_per_clus_shift = log2OfPowerOf2(vol->sec_per_clus);
+    vol->bytes_per_clus_shift = log2OfPowerOf2(vol->bytes_per_clus);
+
+    // the layout is computed in DWORD, so that a crafted header could not wrap it into the image
+    // sector numbers are kept in WORD, which is enough for any legal sector size
+    DWORD total_sectors = FLOPPY_SIZE / vol->bytes_per_sec;
+    DWORD root_head_sec = 1 + (DWORD)header->BPB_NumFATs * header->BPB_FATSz16;
+    // assume bytes of root directory is a multiple of bytes per sector
+    DWORD root_sectors = (DWORD)header->BPB_RootEntCnt * sizeof(file_entry) / vol->bytes_per_sec;
+    DWORD data_head_sec = root_head_sec + root_sectors;
+    if (vol->entries_per_clus == 0 || header->BPB_NumFATs == 0 || total_sectors > 0xFFFF ||
+        data_head_sec >= total_sectors) {
+        return 0;
+    }
+    if ((total_sectors - data_head_sec) / vol->sec_per_clus >= FAT12_MAX_CLUSTERS) return 0;
+    vol->num_FATs = header->BPB_NumFATs;
+    vol->secs_per_FAT = header->BPB_FATSz16;
+    vol->FAT_head_sec = 1;
+    vol->root_head_sec = root_head_sec;
+    vol->max_root_entries = header->BPB_RootEntCnt;
+    vol->root_sectors = root_sectors;
+    vol->data_head_sec = data_head_sec;
+    if (!loadFAT(vol)) return 0;
+    vol->dir_indexes = (dir_index**)calloc(vol->clus_count, sizeof(dir_index*));
+    return vol->dir_indexes != NULL;
+}
+
+// pack changes of the decoded FAT back to the floppy, should be called before writing the floppy
+int flushVolume(volume* vol) {
+    if (vol->disk->read_only) return 1;
+    lockVolumeExclusive(vol);
+    int success = flushFAT(vol);
+    unlockVolume(vol);
+    return success;
+}
+
+// free memory allocated in `mountVolume`, changes not flushed are dropped
+void unmountVolume(volume* vol) {
+    if (vol->dir_indexes) {
+        for (WORD i = 0; i < vol->clus_count; ++i) dropDirIndex(vol, i);
+        free(vol->dir_indexes);
+        vol->dir_indexes = NULL;
+    }
+    free(vol->FAT);
+    free(vol->free_extents);
+    vol->FAT = NULL;
+    vol->free_extents = NULL;
+    destroyVolumeLocks(vol);
 }
 
 void initDirWithRoot(directory* dir) {
@@ -77,105 +240,55 @@ void initDirWithRoot(directory* dir) {
     dir->path_str[0] = '/';
 }
 
-void printAllInDir(const floppy* disk, const directory* dir) {
-    const fat12_header* header = (const fat12_header*)disk->storage;
-
-    int sec_per_clus = header->BPB_SecPerClus;
-    int bytes_per_clus = sec_per_clus * header->BPB_BytesPerSec;
-    // assume bytes_per_clus is a multiple of sizeof(file_entry)
-    int entries_per_clus = bytes_per_clus / sizeof(file_entry);
-
-    int FAT_sectors = header->BPB_NumFATs * header->BPB_FATSz16;
-
-    file_vector vector;
-    fileVectorInit(&vector);
-
-    BYTE* now_clus = (BYTE*)malloc(bytes_per_clus); // buffer for loading cluster
-    if (dir->clus_num == 0) {
-        // list root directory
-        int root_head_sec = 1 + FAT_sectors;
-        int max_root_entries = header->BPB_RootEntCnt;
-
-        loadSectors(disk, root_head_sec, sec_per_clus, now_clus);
-        int total = 0, i = 0;
-        while (total < max_root_entries) {
-            const file_entry* ent = &((const file_entry*)now_clus)[i];
-
-            if (*(const BYTE*)ent == 0x00) break; // empty
-            else if (*(const BYTE*)ent != FILE_DEL_BYTE) {
-                fileVectorAppend(&vector, ent);
-            }
-
-            ++total;
+void fprintAllInDir(FILE* out, const volume* vol, const directory* dir) {
+    lockVolumeShared(vol);
+    lockDir(vol, dir->clus_num, 0);
+    // the listing is kept sorted in index of the directory, so only printing is left
+    DWORD count;
+    const ent_loc* listing = getDirListing(vol, dir->clus_num, &count);
+    if (listing) {
+        DWORD i = 0;
+        if (count && (entAtLoc(vol, listing[0])->DIR_Attr & FILE_ATTR_VOLLAB)) {
+            // print volumn label before the bar
+            printFileEnt(out, entAtLoc(vol, listing[0]));
             ++i;
-            if (i >= entries_per_clus) {
-                i = 0;
-                int offset = (total/entries_per_clus) * sec_per_clus;
-                loadSectors(disk, root_head_sec + offset, sec_per_clus, now_clus);
-            }
         }
-    } else {
-        // list normal subdirectory (non-root)
-        int root_bytes = header->BPB_RootEntCnt * sizeof(file_entry);
-        // assume bytes of root directory is a multiple of bytes per sector
-        int root_sectors = root_bytes / header->BPB_BytesPerSec;
-        int data_head_sec = 1 + FAT_sectors + root_sectors;
-
-        int now_clus_num = dir->clus_num;
-        int logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-        loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-        int i = 0;
-        for (;;) {
-            const file_entry* ent = &((const file_entry*)now_clus)[i];
-
-            if (*(const BYTE*)ent == 0x00) break; //empty
-            else if (*(const BYTE*)ent != FILE_DEL_BYTE) {
-                fileVectorAppend(&vector, ent);
-            }
-
-            ++i;
-            if (i >= entries_per_clus) {
-                i = 0;
-                now_clus_num = getNextClusNumFromFAT(disk, now_clus_num);
-                if (clusNumIsEOF(now_clus_num)) break;
-                logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-                loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-            }
+        fprintf(out, "Attribute Name    Type      Size   Last Changed Time\n");
+        for (; i < count; ++i) {
+            printFileEnt(out, entAtLoc(vol, listing[i]));
         }
     }
-    free(now_clus);
+    unlockDir(vol, dir->clus_num);
+    unlockVolume(vol);
+}
 
-    qsort(vector.storage, vector.size, sizeof(file_entry), fileEntCmp);
-    int i = 0;
-    if (vector.storage[0].DIR_Attr & FILE_ATTR_VOLLAB) {
-        // print volumn label before the bar
-        printFileEnt(&vector.storage[0]);
-        ++i;
-    }
-    printf("Attribute Name    Type      Size   Last Changed Time\n");
-    for (; i < vector.size; ++i) {
-        printFileEnt(&vector.storage[i]);
-    }
-    fileVectorDestroy(&vector);
+void printAllInDir(const volume* vol, const directory* dir) {
+    fprintAllInDir(stdout, vol, dir);
+}
+
+void fprintDirTree(FILE* out, const volume* vol, const directory* dir) {
+    // children are copied from the listings kept in index, and each directory is locked only while copying
+    lockVolumeShared(vol);
+    printDirTreeByClus(out, vol, dir->clus_num, "", 0);
+    unlockVolume(vol);
 }
 
-void printDirTree(const floppy* disk, const directory* dir) {
-    ent_tree* tree = getEntTree(disk, dir->clus_num);
-    printEntTree(tree, "", 0);
-    entTreeDestroy(tree);
+void printDirTree(const volume* vol, const directory* dir) {
+    fprintDirTree(stdout, vol, dir);
 }
 
 // return 1 when directory is changed successfully, else return 0
-int changeDirectory(const floppy* disk, directory* dir, const char* path) {
-    file_entry* ent = getFileEntByPath(disk, dir->clus_num, path);
-    if (!ent) { // not found or path illegal
+int changeDirectory(const volume* vol, directory* dir, const char* path) {
+    file_entry ent;
+    lockVolumeShared(vol);
+    int found = getFileEntByPath(vol, dir->clus_num, path, &ent);
+    unlockVolume(vol);
+    if (!found) { // not found or path illegal
         return 0;
-    } else if (!(ent->DIR_Attr & FILE_ATTR_DIR)) { // not a directory
-        free(ent);
+    } else if (!(ent.DIR_Attr & FILE_ATTR_DIR)) { // not a directory
         return 0;
     }
-    dir->clus_num = ent->DIR_FstClus;
-    free(ent);
+    dir->clus_num = ent.DIR_FstClus;
 
     // adjust dir->path_str
     int len = strlen(path);
@@ -202,252 +315,470 @@ int changeDirectory(const floppy* disk, directory* dir, const char* path) {
     return 1;
 }
 
+// look up the entry again after its directory is locked, as it may have been changed since it was found
+// return 1 if it is still there
+static int refreshEntRef(const volume* vol, ent_ref* ref) {
+    BYTE name[11];
+    memcpy(name, ref->ent.DIR_Name, 11);
+    return getFileEntRefByFATName(vol, ref->dir_clus_num, name, ref);
+}
+
+// open the file of the entry, whose directory is locked by the caller, return 1 when success
+static int openFileByRef(const volume* vol, const ent_ref* ref, int writable, file_handle* fh) {
+    if (ref->ent.DIR_Attr & FILE_ATTR_DIR) return 0; // not a file
+    if (writable && (ref->ent.DIR_Attr & FILE_ATTR_RO)) return 0; // not a writable file
+    if (!openFileByEnt(vol, &ref->ent, fh)) return 0;
+    fh->writable = writable;
+    fh->loc = ref->loc;
+    fh->dir_clus_num = ref->dir_clus_num;
+    return 1;
+}
+
+// functions of handles below are called with the directory of the file locked
+
+static size_t readFileNoLock(file_handle* fh, void* buf, size_t len) {
+    if (len > fh->size - fh->pos) len = fh->size - fh->pos;
+    BYTE* out = (BYTE*)buf;
+    size_t left = len;
+    while (left > 0) {
+        // copy a whole extent at once
+        size_t offset;
+        size_t size = fileSpanAtPos(fh, left, &offset);
+        memcpy(out, fh->vol->disk->storage + offset, size);
+        out += size;
+        left -= size;
+        fh->pos += size;
+    }
+    return len;
+}
+
+static int nextFileSpanNoLock(file_handle* fh, const BYTE** ptr, size_t* len) {
+    if (fh->pos >= fh->size) return 0;
+    size_t offset;
+    *len = fileSpanAtPos(fh, fh->size - fh->pos, &offset);
+    *ptr = fh->vol->disk->storage + offset;
+    fh->pos += *len;
+    return 1;
+}
+
+static int writeFileNoLock(file_handle* fh, const void* buf, size_t len) {
+    volume* vol = fh->vol;
+    if (!fh->writable) return 0;
+    if (len > 0xFFFFFFFFu - fh->pos) return 0; // size of file is a DWORD
+    // extend the chain at its tail for the part beyond it at once, and patch the extent map
+    const DWORD total = fileClusTotal(fh);
+    const DWORD need = bytesToClusCount(vol, (size_t)fh->pos + len);
+    if (need > total) {
+        const file_extent* last = fh->extent_count ? &fh->extents[fh->extent_count - 1] : NULL;
+        WORD tail_clus_num = last ? last->start + last->len - 1 : 0;
+        // the new clusters are written from their head to the end of this write
+        DWORD bytes = (DWORD)(fh->pos + len - (size_t)total * vol->bytes_per_clus);
+        // each new cluster adds at most one extent, so the map could not run out once the chain is extended
+        if (!reserveFileExtents(fh, fh->extent_count + (int)(need - total))) return 0;
+        WORD alloc_clus_num = allocFATClusForWrite(vol, bytes, tail_clus_num);
+        if (!alloc_clus_num) return 0; // disk is full
+        if (!fh->head_clus_num) fh->head_clus_num = alloc_clus_num;
+        for (WORD i = alloc_clus_num; !clusNumIsEOF(i); i = getNextClusNumFromFAT(vol, i)) {
+            appendFileExtent(fh, i);
+        }
+    }
+    const BYTE* in = (const BYTE*)buf;
+    size_t left = len;
+    while (left > 0) {
+        // write a whole extent at once
+        size_t offset;
+        size_t size = fileSpanAtPos(fh, left, &offset);
+        markDirty(vol->disk, offset, size);
+        memcpy(vol->disk->storage + offset, in, size);
+        in += size;
+        left -= size;
+        fh->pos += size;
+    }
+    if (fh->pos > fh->size) fh->size = fh->pos;
+    fh->changed = 1;
+    return 1;
+}
+
+static int truncateFileNoLock(file_handle* fh, DWORD size) {
+    volume* vol = fh->vol;
+    if (!fh->writable || size > fh->size) return 0;
+    // an empty file still holds one cluster
+    DWORD keep = bytesToClusCount(vol, size);
+    if (keep == 0) keep = 1;
+    if (keep < fileClusTotal(fh)) {
+        // cut the extent map and the chain after cluster `keep - 1` of the file
+        int i = findFileExtent(fh, keep - 1);
+        file_extent* ext = &fh->extents[i];
+        ext->len = keep - ext->file_clus;
+        fh->extent_count = i + 1;
+        WORD last_clus_num = ext->start + ext->len - 1;
+        WORD rest_clus_num = getNextClusNumFromFAT(vol, last_clus_num);
+        pthread_mutex_lock(&vol->alloc_lock);
+        setFATEntry(vol, last_clus_num, EOF_CLUSTER_NUM);
+        pthread_mutex_unlock(&vol->alloc_lock);
+        freeFATClus(vol, rest_clus_num);
+        if (fh->extent_index > i) fh->extent_index = i;
+    }
+    fh->size = size;
+    seekFile(fh, fh->pos < size ? fh->pos : size);
+    fh->changed = 1;
+    return 1;
+}
+
+static void closeFileNoLock(file_handle* fh) {
+    if (fh->writable && fh->changed) {
+        file_entry ent = *entAtLoc(fh->vol, fh->loc);
+        ent.DIR_FstClus = fh->head_clus_num;
+        ent.DIR_FileSize = fh->size;
+        time_t t = time(NULL);
+        struct tm now_time;
+        localtime_r(&t, &now_time);
+        WORD wrt_time, wrt_date;
+        setWrtTime(&now_time, &wrt_time, &wrt_date); // set time
+        ent.DIR_WrtTime = wrt_time;
+        ent.DIR_WrtDate = wrt_date;
+        writeEntAtLoc(fh->vol, fh->loc, &ent);
+    }
+    free(fh->extents);
+    fh->extents = NULL;
+    fh->vol = NULL;
+}
+
 // return 1 in case success, else return 0
-int printFileContentByPath(const floppy* disk, const directory* dir, const char* path) {
-    file_entry* ent = getFileEntByPath(disk, dir->clus_num, path);
-    if (!ent) { // not found or path illegal
-        return 0;
-    } else if (ent->DIR_Attr & FILE_ATTR_DIR) { // not a file
-        free(ent);
-        return 0;
+int fprintFileContentByPath(FILE* out, const volume* vol, const directory* dir, const char* path) {
+    ent_ref ref;
+    file_handle fh;
+    int ok = 0;
+    lockVolumeShared(vol);
+    if (getFileEntRefByPath(vol, dir->clus_num, path, &ref) && !(ref.ent.DIR_Attr & FILE_ATTR_DIR)) {
+        lockDir(vol, ref.dir_clus_num, 0);
+        ok = refreshEntRef(vol, &ref) && openFileByRef(vol, &ref, 0, &fh);
+        if (ok) {
+            // write the image bytes out in place, one run of continuous clusters at a time
+            const BYTE* span;
+            size_t len;
+            while (nextFileSpanNoLock(&fh, &span, &len)) {
+                fwrite(span, 1, len, out);
+            }
+            fputc('\n', out);
+            closeFileNoLock(&fh);
+        }
+        unlockDir(vol, ref.dir_clus_num);
     }
-    BYTE* buffer = (BYTE*)malloc(ent->DIR_FileSize);
-    int loaded = readFileContentByEnt(disk, ent, buffer);
-    if (loaded == 0) return 0; // something wrong with the file entry
-    for (unsigned int i = 0; i < ent->DIR_FileSize; ++i) {
-        putchar(buffer[i]);
+    unlockVolume(vol);
+    return ok;
+}
+
+// return 1 in case success, else return 0
+int printFileContentByPath(const volume* vol, const directory* dir, const char* path) {
+    return fprintFileContentByPath(stdout, vol, dir, path);
+}
+
+// open file using path relative to directory, return 1 when success, else return 0
+int openFileByPath(const volume* vol, const directory* dir, const char* path, file_handle* fh) {
+    ent_ref ref;
+    int ok = 0;
+    lockVolumeShared(vol);
+    if (getFileEntRefByPath(vol, dir->clus_num, path, &ref) && !(ref.ent.DIR_Attr & FILE_ATTR_DIR)) {
+        lockDir(vol, ref.dir_clus_num, 0);
+        ok = refreshEntRef(vol, &ref) && openFileByRef(vol, &ref, 0, fh);
+        unlockDir(vol, ref.dir_clus_num);
     }
-    putchar('\n');
-    free(buffer);
-    free(ent);
+    unlockVolume(vol);
+    return ok;
+}
+
+// read at most `len` bytes from current position, return number of bytes read
+size_t readFile(file_handle* fh, void* buf, size_t len) {
+    const volume* vol = fh->vol;
+    const WORD dir_clus_num = fh->dir_clus_num;
+    lockVolumeShared(vol);
+    lockDir(vol, dir_clus_num, 0);
+    len = readFileNoLock(fh, buf, len);
+    unlockDir(vol, dir_clus_num);
+    unlockVolume(vol);
+    return len;
+}
+
+// get bytes from current position to the end of its extent as a span pointing into the image
+// return 1 when a span is got, else return 0 at the end of the file
+int nextFileSpan(file_handle* fh, const BYTE** ptr, size_t* len) {
+    const volume* vol = fh->vol;
+    const WORD dir_clus_num = fh->dir_clus_num;
+    lockVolumeShared(vol);
+    lockDir(vol, dir_clus_num, 0);
+    int ok = nextFileSpanNoLock(fh, ptr, len);
+    unlockDir(vol, dir_clus_num);
+    unlockVolume(vol);
+    return ok;
+}
+
+// read at most `len` bytes from `offset` without moving current position
+size_t readFileAt(file_handle* fh, DWORD offset, void* buf, size_t len) {
+    file_handle at = *fh; // share the extent map with a copy, so `fh` stays where it is
+    if (!seekFile(&at, offset)) return 0;
+    return readFile(&at, buf, len);
+}
+
+// move current position to `pos`, return 1 when success, else return 0
+// only the handle is used, so no lock is needed
+int seekFile(file_handle* fh, DWORD pos) {
+    if (pos > fh->size) return 0;
+    if (fh->extent_count) {
+        const DWORD bytes_per_clus = fh->vol->bytes_per_clus;
+        const file_extent* ext = &fh->extents[fh->extent_index];
+        size_t ext_head = (size_t)ext->file_clus * bytes_per_clus;
+        size_t ext_end = ext_head + (size_t)ext->len * bytes_per_clus;
+        if (pos < ext_head || pos > ext_end) { // not in current extent
+            fh->extent_index = findFileExtent(fh, pos / bytes_per_clus);
+        }
+    }
+    fh->pos = pos;
     return 1;
 }
 
-// copy file using path relative to directory, return 1 when succeed else return 0
-int copyFileByPath(floppy* disk, const directory* dir, const char* src, const char* des) {
-    const fat12_header* const header = (const fat12_header* const)disk->storage;
-    int bytes_per_clus = header->BPB_SecPerClus * header->BPB_BytesPerSec;
+// open an existing file for read and write, return 1 when success, else return 0
+int openFileForWriteByPath(volume* vol, const directory* dir, const char* path, file_handle* fh) {
+    if (vol->disk->read_only) return 0;
+    ent_ref ref;
+    int ok = 0;
+    lockVolumeShared(vol);
+    if (getFileEntRefByPath(vol, dir->clus_num, path, &ref) && !(ref.ent.DIR_Attr & FILE_ATTR_DIR)) {
+        lockDir(vol, ref.dir_clus_num, 0);
+        ok = refreshEntRef(vol, &ref) && openFileByRef(vol, &ref, 1, fh);
+        unlockDir(vol, ref.dir_clus_num);
+    }
+    unlockVolume(vol);
+    return ok;
+}
 
-    file_entry* src_ent = getFileEntByPath(disk, dir->clus_num, src);
-    if (!src_ent) return 0; // not found
-    else if (src_ent->DIR_Attr & FILE_ATTR_DIR) { // not a file
-        free(src_ent);
-        return 0;
+// write `len` bytes at current position and move it, return 1 when success, else return 0
+int writeFile(file_handle* fh, const void* buf, size_t len) {
+    volume* vol = fh->vol;
+    const WORD dir_clus_num = fh->dir_clus_num;
+    lockVolumeShared(vol);
+    lockDir(vol, dir_clus_num, 1);
+    int ok = writeFileNoLock(fh, buf, len);
+    unlockDir(vol, dir_clus_num);
+    unlockVolume(vol);
+    return ok;
+}
+
+// cut the file to `size` bytes, return 1 when success, else return 0
+int truncateFile(file_handle* fh, DWORD size) {
+    volume* vol = fh->vol;
+    const WORD dir_clus_num = fh->dir_clus_num;
+    lockVolumeShared(vol);
+    lockDir(vol, dir_clus_num, 1);
+    int ok = truncateFileNoLock(fh, size);
+    unlockDir(vol, dir_clus_num);
+    unlockVolume(vol);
+    return ok;
+}
+
+// write back size, head cluster and time of the file if it is changed, and free the extent map
+void closeFile(file_handle* fh) {
+    if (!(fh->writable && fh->changed)) {
+        closeFileNoLock(fh); // only the handle is freed
+        return;
     }
-    // Seperate destination directory (should exist already) and filename (should not exist)
+    volume* vol = fh->vol;
+    const WORD dir_clus_num = fh->dir_clus_num;
+    lockVolumeShared(vol);
+    lockDir(vol, dir_clus_num, 1);
+    closeFileNoLock(fh);
+    unlockDir(vol, dir_clus_num);
+    unlockVolume(vol);
+}
+
+// Seperate destination directory (should exist already) and file name in `des`
+// `name` is set to the name after the last '/', which is empty if `des` ends with '/'
+// return 1 when the directory is found, else return 0
+static int findDesDir(const volume* vol, const directory* dir, const char* des, WORD* des_dir, const char** name) {
     int len = strlen(des);
     int i;
     for (i = len - 1; i >= 0; --i) {
         if (des[i] == '/') break;
     }
-    WORD des_dir = dir->clus_num;
+    *des_dir = dir->clus_num;
+    *name = des + (i + 1);
     if (i >= 0) { // path includes a direcotry path before file name
-        char* dir_path = (char*)malloc((i + 2) * sizeof(char));
-        memcpy(dir_path, des, (i + 1));
-        dir_path[i + 1] = '\0';
-        file_entry* des_dir_ent = getFileEntByPath(disk, dir->clus_num, dir_path);
-        free(dir_path);
-        if (!des_dir_ent) {
-            free(src_ent);
-            return 0;
-        }
-        des_dir = des_dir_ent->DIR_FstClus;
-        free(des_dir_ent);
+        ent_ref des_dir_ref;
+        if (!getFileEntRefByPathLen(vol, dir->clus_num, des, i + 1, &des_dir_ref)) return 0;
+        *des_dir = des_dir_ref.ent.DIR_FstClus;
     }
-    char file_name[32];
-    if (i == len - 1) {
+    return 1;
+}
+
+// find the destination of copying or moving `src_ent` to `des`, return 1 when succeed else return 0
+// when `des` is an existing directory, the destination is in it with the same name as `src_ent`
+static int findCopyDes(const volume* vol, const directory* dir, const file_entry* src_ent, const char* des,
+    WORD* des_dir, char* file_name)
+{
+    const char* name;
+    if (!findDesDir(vol, dir, des, des_dir, &name)) return 0;
+    if (*name == '\0') {
         // given a directory path and no file name appointed, just use the same name as src
         formatNameToNormal(src_ent->DIR_Name, file_name);
     } else {
-        int name_len = len - (i + 1);
+        int name_len = strlen(name);
         if (name_len > 31) name_len = 31; // prevent out-of-bounds access
-        memcpy(file_name, des + i + 1, name_len);
+        memcpy(file_name, name, name_len);
         file_name[name_len] = '\0';
     }
     // Check if a file using the name exists in the directory
-    file_entry* test = getFileEntByName(disk, des_dir, file_name);
-    if (test) {
-        if (!(test->DIR_Attr & FILE_ATTR_DIR)) { // destination file already exists
-            free(test);
-            free(src_ent);
+    file_entry test;
+    lockDir(vol, *des_dir, 0);
+    int exists = getFileEntByName(vol, *des_dir, file_name, &test);
+    unlockDir(vol, *des_dir);
+    if (exists) {
+        if (!(test.DIR_Attr & FILE_ATTR_DIR)) { // destination file already exists
             return 0;
         } else { // given a directory name without a '/'
-            des_dir = test->DIR_FstClus;
+            *des_dir = test.DIR_FstClus;
             formatNameToNormal(src_ent->DIR_Name, file_name); // use the same name as src
-            free(test);
         }
     }
     // Check "." and ".."
     if (!strcmp(file_name, ".") || !strcmp(file_name, "..")) {
-        free(src_ent);
         return 0;
     }
+    return 1;
+}
+
+// copy the file of `src_ref` as `file_name` in `des_dir`, both directories are locked by the caller
+static int copyFileInDirs(volume* vol, ent_ref* src_ref, WORD des_dir, const char* file_name) {
+    if (!refreshEntRef(vol, src_ref) || (src_ref->ent.DIR_Attr & FILE_ATTR_DIR)) return 0;
+    file_entry test;
+    if (getFileEntByName(vol, des_dir, file_name, &test)) return 0; // created by others just now
     // set destination file entry content
     file_entry des_ent;
-    memcpy(&des_ent, src_ent, sizeof(file_entry));
+    memcpy(&des_ent, &src_ref->ent, sizeof(file_entry));
     formatNameToFATType(file_name, des_ent.DIR_Name); // set name
 
     time_t t = time(NULL);
-    const struct tm* now_time = localtime(&t);
-    setWrtTime(now_time, &des_ent.DIR_WrtTime, &des_ent.DIR_WrtDate); // set time
+    struct tm now_time;
+    localtime_r(&t, &now_time);
+    WORD wrt_time, wrt_date;
+    setWrtTime(&now_time, &wrt_time, &wrt_date); // set time
+    des_ent.DIR_WrtTime = wrt_time;
+    des_ent.DIR_WrtDate = wrt_date;
 
-    int num_clus = (des_ent.DIR_FileSize + bytes_per_clus-1)/bytes_per_clus; // round up
-    des_ent.DIR_FstClus = allocFATClus(disk, num_clus, 0); // set first cluster
+    // clusters are overwritten by the copy, so only the rest of the last one is cleaned up
+    des_ent.DIR_FstClus = allocFATClusForWrite(vol, des_ent.DIR_FileSize, 0); // set first cluster
     if (des_ent.DIR_FstClus == 0) { // no space
-        free(src_ent);
         return 0;
     }
-    // copy content to disk
-    BYTE* buffer = (BYTE*)malloc(src_ent->DIR_FileSize);
-    if (!readFileContentByEnt(disk, src_ent, buffer) || 
-        !writeFileContentByEnt(disk, &des_ent, buffer)) {
-        // read or write failed
-        freeFATClus(disk, des_ent.DIR_FstClus);
-        free(src_ent);
+    // copy content from cluster to cluster in the image
+    if (!copyFileContentByEnt(vol, &src_ref->ent, des_ent.DIR_FstClus)) {
+        freeFATClus(vol, des_ent.DIR_FstClus);
         return 0;
     }
-    free(buffer);
-    free(src_ent);
-    if (!appendEntInDir(disk, des_dir, &des_ent)) { // failed to append
-        freeFATClus(disk, des_ent.DIR_FstClus);
+    if (!appendEntInDir(vol, des_dir, &des_ent)) { // failed to append
+        freeFATClus(vol, des_ent.DIR_FstClus);
         return 0;
     }
     return 1;
 }
 
+// copy file using path relative to directory, return 1 when succeed else return 0
+int copyFileByPath(volume* vol, const directory* dir, const char* src, const char* des) {
+    if (vol->disk->read_only) return 0;
+    lockVolumeShared(vol);
+    ent_ref src_ref;
+    WORD des_dir;
+    char file_name[32];
+    int ok = getFileEntRefByPath(vol, dir->clus_num, src, &src_ref)
+        && !(src_ref.ent.DIR_Attr & FILE_ATTR_DIR) // not a file
+        && findCopyDes(vol, dir, &src_ref.ent, des, &des_dir, file_name);
+    if (ok) {
+        dir_lock_set locks;
+        dirLockSetInit(&locks);
+        dirLockSetAdd(&locks, src_ref.dir_clus_num, 0);
+        dirLockSetAdd(&locks, des_dir, 1);
+        lockDirs(vol, &locks);
+        ok = copyFileInDirs(vol, &src_ref, des_dir, file_name);
+        unlockDirs(vol, &locks);
+    }
+    unlockVolume(vol);
+    return ok;
+}
+
 // return 1 when succeed, else return 0
-int removeFileByPath(floppy* disk, const directory* dir, const char* path) {
-    ent_clus* info = getFileEntWithClusInfoByPath(disk, dir->clus_num, path);
-    if (!info) return 0; // not found
-    if (info->ent->DIR_Attr & FILE_ATTR_DIR) { // not a file
-        destroyEntClusInfo(info);
-        return 0;
+int removeFileByPath(volume* vol, const directory* dir, const char* path) {
+    if (vol->disk->read_only) return 0;
+    lockVolumeShared(vol);
+    ent_ref ref;
+    int ok = getFileEntRefByPath(vol, dir->clus_num, path, &ref) && !(ref.ent.DIR_Attr & FILE_ATTR_DIR);
+    if (ok) {
+        lockDir(vol, ref.dir_clus_num, 1);
+        ok = refreshEntRef(vol, &ref) && !(ref.ent.DIR_Attr & FILE_ATTR_DIR);
+        if (ok) {
+            freeFATClus(vol, ref.ent.DIR_FstClus);
+            deleteEntByRef(vol, &ref);
+        }
+        unlockDir(vol, ref.dir_clus_num);
     }
-    freeFATClus(disk, info->ent->DIR_FstClus);
-    *(BYTE*)info->ent = FILE_DEL_BYTE;
-    writeSectors(disk, info->logic_sec_num, info->sec_per_clus, info->clus_buf);
-    destroyEntClusInfo(info);
-    return 1;
+    unlockVolume(vol);
+    return ok;
 }
 
-// move file or dir using path relative to directory, return 1 when succeed else return 0
-int moveFileByPath(floppy* disk, const directory* dir, const char* src, const char* des) {
-    ent_clus* src_info = getFileEntWithClusInfoByPath(disk, dir->clus_num, src);
-    if (!src_info) return 0; // not found
-    char src_name[12];
-    memcpy(src_name, src_info->ent->DIR_Name, 11);
-    src_name[11] = '\0';
-    if (src_info->ent->DIR_FstClus == 0 || 
-        !strcmp(src_name, ".          ") || !strcmp(src_name, "..         ")) {
+// moving under the volume locked exclusively, return 1 when succeed else return 0
+static int moveFileInVolume(volume* vol, const directory* dir, const char* src, const char* des) {
+    ent_ref src_ref;
+    if (!getFileEntRefByPath(vol, dir->clus_num, src, &src_ref)) return 0; // not found
+    if (src_ref.ent.DIR_FstClus == 0 || entIsDotOrDotDot(&src_ref.ent)) {
         // src is root or reserved entry
-        destroyEntClusInfo(src_info);
         return 0;
     }
-    // Seperate destination directory (should exist already) and filename (should not exist)
-    int len = strlen(des);
-    int i;
-    for (i = len - 1; i >= 0; --i) {
-        if (des[i] == '/') break;
-    }
-    WORD des_dir = dir->clus_num;
-    if (i >= 0) { // path includes a direcotry path before file name
-        char* dir_path = (char*)malloc((i + 2) * sizeof(char));
-        memcpy(dir_path, des, (i + 1));
-        dir_path[i + 1] = '\0';
-        file_entry* des_dir_ent = getFileEntByPath(disk, dir->clus_num, dir_path);
-        free(dir_path);
-        if (!des_dir_ent) {
-            destroyEntClusInfo(src_info);
-            return 0;
-        }
-        des_dir = des_dir_ent->DIR_FstClus;
-        free(des_dir_ent);
-    }
+    WORD des_dir;
     char file_name[32];
-    if (i == len - 1) {
-        // given a directory path and no file name appointed, just use the same name as src
-        formatNameToNormal(src_info->ent->DIR_Name, file_name);
-    } else {
-        int name_len = len - (i + 1);
-        if (name_len > 31) name_len = 31; // prevent out-of-bounds access
-        memcpy(file_name, des + i + 1, name_len);
-        file_name[name_len] = '\0';
-    }
-    // Check if a file using the name exists in the directory
-    file_entry* test = getFileEntByName(disk, des_dir, file_name);
-    if (test) {
-        if (!(test->DIR_Attr & FILE_ATTR_DIR)) { // destination file already exists
-            free(test);
-            destroyEntClusInfo(src_info);
-            return 0;
-        } else { // given a directory name without a '/'
-            des_dir = test->DIR_FstClus;
-            formatNameToNormal(src_info->ent->DIR_Name, file_name); // use the same name as src
-            free(test);
-        }
-    }
-    // Check "." and ".."
-    if (!strcmp(file_name, ".") || !strcmp(file_name, "..")) {
-        destroyEntClusInfo(src_info);
-        return 0;
-    }
+    if (!findCopyDes(vol, dir, &src_ref.ent, des, &des_dir, file_name)) return 0;
     // Check parent relationship
-    if (src_info->ent->DIR_Attr & FILE_ATTR_DIR) {
-        if (isParent(disk, src_info->ent->DIR_FstClus, des_dir)) {
-            destroyEntClusInfo(src_info);
+    if (src_ref.ent.DIR_Attr & FILE_ATTR_DIR) {
+        if (isParent(vol, src_ref.ent.DIR_FstClus, des_dir)) {
             return 0;
         }
     }
     // set destination file entry content
     file_entry des_ent;
-    memcpy(&des_ent, src_info->ent, sizeof(file_entry));
+    memcpy(&des_ent, &src_ref.ent, sizeof(file_entry));
     formatNameToFATType(file_name, des_ent.DIR_Name); // set name
 
     time_t t = time(NULL);
-    const struct tm* now_time = localtime(&t);
-    setWrtTime(now_time, &des_ent.DIR_WrtTime, &des_ent.DIR_WrtDate); // set time
-
-    // mark source file entry as deleted
-    BYTE backup = *(BYTE*)(src_info->ent); // to used when need recover
-    *(BYTE*)(src_info->ent) = FILE_DEL_BYTE;
-    writeSectors(disk, src_info->logic_sec_num, src_info->sec_per_clus, src_info->clus_buf);
-    // add destination file entry to disk, this should after delete source entry
-    // because `clus_buf` of `src_info` has probability of coverring added entry
-    if (!appendEntInDir(disk, des_dir, &des_ent)) { // failed to append
-        *(BYTE*)(src_info->ent) = backup; // recover
-        writeSectors(disk, src_info->logic_sec_num, src_info->sec_per_clus, src_info->clus_buf);
-        destroyEntClusInfo(src_info);
+    struct tm now_time;
+    localtime_r(&t, &now_time);
+    WORD wrt_time, wrt_date;
+    setWrtTime(&now_time, &wrt_time, &wrt_date); // set time
+    des_ent.DIR_WrtTime = wrt_time;
+    des_ent.DIR_WrtDate = wrt_date;
+
+    // mark source file entry as deleted, this should before adding destination entry
+    // so that the slot of source entry could be reused
+    deleteEntByRef(vol, &src_ref);
+    if (!appendEntInDir(vol, des_dir, &des_ent)) { // failed to append
+        writeEntAtLoc(vol, src_ref.loc, &src_ref.ent); // recover
+        dropDirIndex(vol, src_ref.dir_clus_num); // the slot is free in index, so rebuild it
         return 0;
     }
-    destroyEntClusInfo(src_info);
     return 1;
 }
 
-// return 1 when succeed else return 0
-int makeDirByPath(floppy* disk, const directory* dir, const char* path) {
-    // Seperate destination directory (should exist already) and new dirname (should not exist)
-    int len = strlen(path);
-    int i;
-    for (i = len - 1; i >= 0; --i) {
-        if (path[i] == '/') break;
-    }
-    if (i == len - 1) return 0; // given a directory path and no new dirname appointed
-    WORD des_dir = dir->clus_num;
-    if (i >= 0) { // path includes a direcotry path before new dirname
-        char* dir_path = (char*)malloc((i + 2) * sizeof(char));
-        memcpy(dir_path, path, (i + 1));
-        dir_path[i + 1] = '\0';
-        file_entry* des_dir_ent = getFileEntByPath(disk, dir->clus_num, dir_path);
-        free(dir_path);
-        if (!des_dir_ent) return 0; // illegal path
-        des_dir = des_dir_ent->DIR_FstClus;
-        free(des_dir_ent);
-    }
-    const char* dirname = path + (i + 1);
+// move file or dir using path relative to directory, return 1 when succeed else return 0
+// moving changes the shape of the directory tree, so the volume is locked exclusively
+int moveFileByPath(volume* vol, const directory* dir, const char* src, const char* des) {
+    if (vol->disk->read_only) return 0;
+    lockVolumeExclusive(vol);
+    int ok = moveFileInVolume(vol, dir, src, des);
+    unlockVolume(vol);
+    return ok;
+}
+
+// make the directory in `des_dir`, which is locked for write by the caller
+static int makeDirInDir(volume* vol, WORD des_dir, const char* dirname) {
     // Check if a file using the name exists in the directory
-    file_entry* test = getFileEntByName(disk, des_dir, dirname);
-    if (test) {
-        free(test);
+    file_entry test;
+    if (getFileEntByName(vol, des_dir, dirname, &test)) {
         return 0;
     }
     // append the new directory entry to destination directory
@@ -456,117 +787,78 @@ int makeDirByPath(floppy* disk, const directory* dir, const char* path) {
     newdir.DIR_Attr = FILE_ATTR_DIR; // set attribute
     memset(newdir.Reserve, 0, 10); // set reserved
     time_t t = time(NULL);
-    struct tm* now_time = localtime(&t);
-    setWrtTime(now_time, &newdir.DIR_WrtTime, &newdir.DIR_WrtDate); // set time
-    newdir.DIR_FstClus = allocFATClus(disk, 1, 0); // alloc cluster
+    struct tm now_time;
+    localtime_r(&t, &now_time);
+    WORD wrt_time, wrt_date;
+    setWrtTime(&now_time, &wrt_time, &wrt_date); // set time
+    newdir.DIR_WrtTime = wrt_time;
+    newdir.DIR_WrtDate = wrt_date;
+    newdir.DIR_FstClus = allocFATClus(vol, 1, 0); // alloc cluster
     if (!newdir.DIR_FstClus) return 0; // probably space is run out
     newdir.DIR_FileSize = 0; // set size (for directory is 0)
-    if (!appendEntInDir(disk, des_dir, &newdir)) {
-        freeFATClus(disk, newdir.DIR_FstClus);
+    if (!appendEntInDir(vol, des_dir, &newdir)) {
+        freeFATClus(vol, newdir.DIR_FstClus);
         return 0;
     }
-    // create "." and ".." entries
+    // create "." and ".." entries, no one else could find the new directory before `des_dir` is unlocked
     WORD newdir_clus_num = newdir.DIR_FstClus;
     memcpy(newdir.DIR_Name, ".          ", 11);
-    appendEntInDir(disk, newdir_clus_num, &newdir); // This MUST be success
+    appendEntInDir(vol, newdir_clus_num, &newdir); // This MUST be success
     newdir.DIR_Name[1] = '.';
     newdir.DIR_FstClus = des_dir; // parent directory
-    appendEntInDir(disk, newdir_clus_num, &newdir); // This MUST be success
+    appendEntInDir(vol, newdir_clus_num, &newdir); // This MUST be success
     return 1;
 }
 
-// remove a directory (and everything in it). Return 1 when succeed else return 0
-int removeDirByPath(floppy* disk, const directory* dir, const char* path) {
-    ent_clus* info = getFileEntWithClusInfoByPath(disk, dir->clus_num, path);
-    if (!info) return 0; // not found
-    char ent_name[12];
-    ent_name[11] = '\0';
-    memcpy(ent_name, info->ent->DIR_Name, 11);
-    if (!(info->ent->DIR_Attr & FILE_ATTR_DIR) || info->ent->DIR_FstClus == 0
-        || !strcmp(ent_name, ".          ") || !strcmp(ent_name, "..         ")) {
-        // not a directory or directory is root or reserved entry
-        destroyEntClusInfo(info);
-        return 0;
+// return 1 when succeed else return 0
+int makeDirByPath(volume* vol, const directory* dir, const char* path) {
+    if (vol->disk->read_only) return 0;
+    lockVolumeShared(vol);
+    // Seperate destination directory (should exist already) and new dirname (should not exist)
+    WORD des_dir;
+    const char* dirname;
+    int ok = findDesDir(vol, dir, path, &des_dir, &dirname)
+        && *dirname != '\0'; // given a directory path and no new dirname appointed
+    if (ok) {
+        lockDir(vol, des_dir, 1);
+        ok = makeDirInDir(vol, des_dir, dirname);
+        unlockDir(vol, des_dir);
     }
-    removeAllInDir(disk, info->ent->DIR_FstClus);
-    freeFATClus(disk, info->ent->DIR_FstClus);
-    *(BYTE*)(info->ent) = FILE_DEL_BYTE;
-    writeSectors(disk, info->logic_sec_num, info->sec_per_clus, info->clus_buf);
-    destroyEntClusInfo(info);
-    return 1;
+    unlockVolume(vol);
+    return ok;
 }
 
-// concat content of two files to one new file, return 1 when succeed else return 0
-int concatFileByPath(floppy* disk, const directory* dir, 
-    const char* src1,
-    const char* src2,
-    const char* des) 
-{
-    const fat12_header* const header = (const fat12_header* const)disk->storage;
-    int bytes_per_clus = header->BPB_SecPerClus * header->BPB_BytesPerSec;
+// remove a directory (and everything in it). Return 1 when succeed else return 0
+// the whole tree is removed at once, so the volume is locked exclusively
+int removeDirByPath(volume* vol, const directory* dir, const char* path) {
+    if (vol->disk->read_only) return 0;
+    lockVolumeExclusive(vol);
+    ent_ref ref;
+    int ok = getFileEntRefByPath(vol, dir->clus_num, path, &ref) // not found
+        // not a directory or directory is root or reserved entry
+        && (ref.ent.DIR_Attr & FILE_ATTR_DIR) && ref.ent.DIR_FstClus != 0 && !entIsDotOrDotDot(&ref.ent);
+    if (ok) ok = removeDirTree(vol, ref.ent.DIR_FstClus);
+    if (ok) deleteEntByRef(vol, &ref);
+    unlockVolume(vol);
+    return ok;
+}
 
-    file_entry* src_ent1 = getFileEntByPath(disk, dir->clus_num, src1);
-    if (!src_ent1) return 0; // not found
-    if (src_ent1->DIR_Attr & FILE_ATTR_DIR) { // not a file
-        free(src_ent1);
-        return 0;
-    }
-    file_entry* src_ent2 = getFileEntByPath(disk, dir->clus_num, src2);
-    if (!src_ent2) { // not found
-        free(src_ent1);
-        return 0;
-    }
-    if (src_ent2->DIR_Attr & FILE_ATTR_DIR) { // not a file
-        free(src_ent1);
-        free(src_ent2);
+// concat the files of `src_ref1` and `src_ref2` as `file_name` in `des_dir`, all directories are locked by the caller
+static int concatFilesInDirs(volume* vol, ent_ref* src_ref1, ent_ref* src_ref2, WORD des_dir, const char* file_name) {
+    if (!refreshEntRef(vol, src_ref1) || (src_ref1->ent.DIR_Attr & FILE_ATTR_DIR)) return 0;
+    if (!refreshEntRef(vol, src_ref2) || (src_ref2->ent.DIR_Attr & FILE_ATTR_DIR)) return 0;
+    // Check if a file using the name exists in the directory
+    file_entry test;
+    if (getFileEntByName(vol, des_dir, file_name, &test)) {
         return 0;
     }
+    const file_entry* src_ent1 = &src_ref1->ent;
+    const file_entry* src_ent2 = &src_ref2->ent;
     int file_size = src_ent1->DIR_FileSize + src_ent2->DIR_FileSize;
     BYTE* buffer = (BYTE*)malloc(file_size);
-    if (!readFileContentByEnt(disk, src_ent1, buffer) ||
-        !readFileContentByEnt(disk, src_ent2, buffer + src_ent1->DIR_FileSize)) {
+    if (!readFileContentByEnt(vol, src_ent1, buffer) ||
+        !readFileContentByEnt(vol, src_ent2, buffer + src_ent1->DIR_FileSize)) {
         // failed to read
-        free(src_ent1);
-        free(src_ent2);
-        free(buffer);
-        return 0;
-    }
-    free(src_ent1);
-    free(src_ent2);
-    // Seperate destination directory (should exist already) and filename (should not exist)
-    int len = strlen(des);
-    int i;
-    for (i = len - 1; i >= 0; --i) {
-        if (des[i] == '/') break;
-    }
-    if (i == len - 1) { // given a directory path and no file name appointed
-        free(buffer);
-        return 0;
-    }
-    WORD des_dir = dir->clus_num;
-    if (i >= 0) { // path includes a direcotry path before file name
-        char* dir_path = (char*)malloc((i + 2) * sizeof(char));
-        memcpy(dir_path, des, (i + 1));
-        dir_path[i + 1] = '\0';
-        file_entry* des_dir_ent = getFileEntByPath(disk, dir->clus_num, dir_path);
-        free(dir_path);
-        if (!des_dir_ent) {
-            free(buffer);
-            return 0;
-        }
-        des_dir = des_dir_ent->DIR_FstClus;
-        free(des_dir_ent);
-    }
-    const char* file_name = des + (i + 1);
-    // Check "." and ".."
-    if (!strcmp(file_name, ".") || !strcmp(file_name, "..")) {
-        free(buffer);
-        return 0;
-    }
-    // Check if a file using the name exists in the directory
-    file_entry* test = getFileEntByName(disk, des_dir, file_name);
-    if (test) {
-        free(test);
         free(buffer);
         return 0;
     }
@@ -576,63 +868,384 @@ int concatFileByPath(floppy* disk, const directory* dir,
     des_ent.DIR_Attr = FILE_ATTR_ARCH; // set attribute
     memset(des_ent.Reserve, 0, 10); // clean reserved (no sense though)
     time_t t = time(NULL);
-    struct tm* now_time = localtime(&t);
-    setWrtTime(now_time, &des_ent.DIR_WrtTime, &des_ent.DIR_WrtDate);
-    int num_clus = (file_size + bytes_per_clus-1)/bytes_per_clus; // round up
-    des_ent.DIR_FstClus = allocFATClus(disk, num_clus, 0);
+    struct tm now_time;
+    localtime_r(&t, &now_time);
+    WORD wrt_time, wrt_date;
+    setWrtTime(&now_time, &wrt_time, &wrt_date);
+    des_ent.DIR_WrtTime = wrt_time;
+    des_ent.DIR_WrtDate = wrt_date;
+    des_ent.DIR_FstClus = allocFATClusForWrite(vol, file_size, 0);
     if (!des_ent.DIR_FstClus) { // failed to allocate cluster
         free(buffer);
         return 0;
     }
     des_ent.DIR_FileSize = file_size;
-    if (!writeFileContentByEnt(disk, &des_ent, buffer)) { // failed to write
-        freeFATClus(disk, des_ent.DIR_FstClus);
+    if (!writeFileContentByEnt(vol, &des_ent, buffer)) { // failed to write
+        freeFATClus(vol, des_ent.DIR_FstClus);
         free(buffer);
         return 0;
     }
     free(buffer);
-    if (!appendEntInDir(disk, des_dir, &des_ent)) { // failed to append entry
-        freeFATClus(disk, des_ent.DIR_FstClus);
+    if (!appendEntInDir(vol, des_dir, &des_ent)) { // failed to append entry
+        freeFATClus(vol, des_ent.DIR_FstClus);
         return 0;
     }
     return 1;
 }
 
-// return 1 when succeed else return 0
-// for convenience this is a completement with low efficiency
-int copyDirByPath(floppy* disk, const directory* dir, const char* src, const char* des) {
-    file_entry* src_ent = getFileEntByPath(disk, dir->clus_num, src);
-    if (!src_ent) return 0;
-    if (!(src_ent->DIR_Attr & FILE_ATTR_DIR)) {
-        free(src_ent);
+// concat content of two files to one new file, return 1 when succeed else return 0
+int concatFileByPath(volume* vol, const directory* dir, 
+    const char* src1,
+    const char* src2,
+    const char* des) 
+{
+    if (vol->disk->read_only) return 0;
+    lockVolumeShared(vol);
+    ent_ref src_ref1, src_ref2;
+    WORD des_dir;
+    const char* file_name;
+    int ok = getFileEntRefByPath(vol, dir->clus_num, src1, &src_ref1) // not found
+        && !(src_ref1.ent.DIR_Attr & FILE_ATTR_DIR) // not a file
+        && getFileEntRefByPath(vol, dir->clus_num, src2, &src_ref2)
+        && !(src_ref2.ent.DIR_Attr & FILE_ATTR_DIR)
+        // Seperate destination directory (should exist already) and filename (should not exist)
+        && findDesDir(vol, dir, des, &des_dir, &file_name)
+        && *file_name != '\0' // given a directory path and no file name appointed
+        // Check "." and ".."
+        && strcmp(file_name, ".") && strcmp(file_name, "..");
+    if (ok) {
+        dir_lock_set locks;
+        dirLockSetInit(&locks);
+        dirLockSetAdd(&locks, src_ref1.dir_clus_num, 0);
+        dirLockSetAdd(&locks, src_ref2.dir_clus_num, 0);
+        dirLockSetAdd(&locks, des_dir, 1);
+        lockDirs(vol, &locks);
+        ok = concatFilesInDirs(vol, &src_ref1, &src_ref2, des_dir, file_name);
+        unlockDirs(vol, &locks);
+    }
+    unlockVolume(vol);
+    return ok;
+}
+
+// append the file of `src_ref` to the file of `des_ref`, both directories are locked by the caller
+static int appendFileInDirs(volume* vol, ent_ref* src_ref, ent_ref* des_ref) {
+    file_handle src_fh, des_fh;
+    if (!refreshEntRef(vol, src_ref) || !refreshEntRef(vol, des_ref)) return 0;
+    if (!openFileByRef(vol, src_ref, 0, &src_fh)) return 0;
+    if (!openFileByRef(vol, des_ref, 1, &des_fh)) {
+        closeFileNoLock(&src_fh);
         return 0;
     }
-    if (!makeDirByPath(disk, dir, des)) {
-        free(src_ent);
+    // only the new bytes are written, existing content of `des` is left as it is
+    const WORD old_head_clus_num = des_fh.head_clus_num;
+    const DWORD old_size = des_fh.size;
+    seekFile(&des_fh, old_size);
+    // bytes appended are always after the end of `src`, so its spans are not overwritten
+    // even if `src` and `des` are the same file
+    const BYTE* span;
+    size_t len;
+    int ok = 1;
+    while (ok && nextFileSpanNoLock(&src_fh, &span, &len)) {
+        ok = writeFileNoLock(&des_fh, span, len);
+    }
+    if (!ok) {
+        // the disk is full in the middle, so clusters appended are given back and the entry is left as it was
+        if (old_head_clus_num) truncateFileNoLock(&des_fh, old_size);
+        else if (des_fh.head_clus_num) freeFATClus(vol, des_fh.head_clus_num);
+        des_fh.changed = 0;
+    }
+    closeFileNoLock(&src_fh);
+    closeFileNoLock(&des_fh);
+    return ok;
+}
+
+// append content of `src` file to the end of existing `des` file, return 1 when succeed else return 0
+int appendFileByPath(volume* vol, const directory* dir, const char* src, const char* des) {
+    if (vol->disk->read_only) return 0;
+    lockVolumeShared(vol);
+    ent_ref src_ref, des_ref;
+    int ok = getFileEntRefByPath(vol, dir->clus_num, src, &src_ref) && !(src_ref.ent.DIR_Attr & FILE_ATTR_DIR)
+        && getFileEntRefByPath(vol, dir->clus_num, des, &des_ref) && !(des_ref.ent.DIR_Attr & FILE_ATTR_DIR);
+    if (ok) {
+        dir_lock_set locks;
+        dirLockSetInit(&locks);
+        dirLockSetAdd(&locks, src_ref.dir_clus_num, 0);
+        dirLockSetAdd(&locks, des_ref.dir_clus_num, 1);
+        lockDirs(vol, &locks);
+        ok = appendFileInDirs(vol, &src_ref, &des_ref);
+        unlockDirs(vol, &locks);
+    }
+    unlockVolume(vol);
+    return ok;
+}
+
+// cut the file to `size` bytes, return 1 when succeed else return 0
+int truncateFileByPath(volume* vol, const directory* dir, const char* path, DWORD size) {
+    if (vol->disk->read_only) return 0;
+    lockVolumeShared(vol);
+    ent_ref ref;
+    file_handle fh;
+    int ok = getFileEntRefByPath(vol, dir->clus_num, path, &ref) && !(ref.ent.DIR_Attr & FILE_ATTR_DIR);
+    if (ok) {
+        lockDir(vol, ref.dir_clus_num, 1);
+        ok = refreshEntRef(vol, &ref) && openFileByRef(vol, &ref, 1, &fh);
+        if (ok) {
+            ok = truncateFileNoLock(&fh, size);
+            closeFileNoLock(&fh);
+        }
+        unlockDir(vol, ref.dir_clus_num);
+    }
+    unlockVolume(vol);
+    return ok;
+}
+
+// copying under the volume locked exclusively, return 1 when succeed else return 0
+static int copyDirInVolume(volume* vol, const directory* dir, const char* src, const char* des) {
+    file_entry src_ent;
+    if (!getFileEntByPath(vol, dir->clus_num, src, &src_ent)) return 0;
+    if (!(src_ent.DIR_Attr & FILE_ATTR_DIR)) {
         return 0;
     }
-    file_entry* des_ent = getFileEntByPath(disk, dir->clus_num, des);
-    if (isParent(disk, src_ent->DIR_FstClus, des_ent->DIR_FstClus)) {
-        removeDirByPath(disk, dir, des);
-        free(src_ent);
-        free(des_ent);
-    }
-    free(des_ent);
-    WORD srcdir_clus_num = src_ent->DIR_FstClus;
-    free(src_ent);
-    ent_tree* tree = getEntTree(disk, srcdir_clus_num);
-    int src_len = strlen(src);
-    int des_len = strlen(des);
-    if (!copyDirInternalRecursion(disk, dir, src, src_len, des, des_len, tree)) {
-        removeDirByPath(disk, dir, des);
-        entTreeDestroy(tree);
+    // Seperate destination directory (should exist already) and new dirname (should not exist)
+    WORD des_dir;
+    const char* dirname;
+    if (!findDesDir(vol, dir, des, &des_dir, &dirname)) return 0; // illegal path
+    if (*dirname == '\0') return 0; // given a directory path and no new dirname appointed
+    // a directory can not be copied into itself
+    if (isParent(vol, src_ent.DIR_FstClus, des_dir)) return 0;
+    // Check if a file using the name exists in the directory
+    file_entry test;
+    if (getFileEntByName(vol, des_dir, dirname, &test)) {
         return 0;
     }
-    entTreeDestroy(tree);
-    return 1;
+    // the new directory is the same as `makeDirByPath` makes
+    file_entry newdir;
+    formatNameToFATType(dirname, newdir.DIR_Name); // set name
+    newdir.DIR_Attr = FILE_ATTR_DIR; // set attribute
+    memset(newdir.Reserve, 0, 10); // set reserved
+    time_t t = time(NULL);
+    struct tm now_time;
+    localtime_r(&t, &now_time);
+    WORD wrt_time, wrt_date;
+    setWrtTime(&now_time, &wrt_time, &wrt_date); // set time
+    newdir.DIR_WrtTime = wrt_time;
+    newdir.DIR_WrtDate = wrt_date;
+    newdir.DIR_FileSize = 0; // set size (for directory is 0)
+    return copyDirTree(vol, src_ent.DIR_FstClus, des_dir, &newdir);
+}
+
+// return 1 when succeed else return 0
+// the source tree is read as a whole, so the volume is locked exclusively
+int copyDirByPath(volume* vol, const directory* dir, const char* src, const char* des) {
+    if (vol->disk->read_only) return 0;
+    lockVolumeExclusive(vol);
+    int ok = copyDirInVolume(vol, dir, src, des);
+    unlockVolume(vol);
+    return ok;
+}
+
+// follow the chain from `head_clus_num` and mark its clusters as used by the `id`th entry in `owner`
+// return number of clusters in the chain, or -1 when it is broken, looped or shared with another entry
+static int checkChain(const volume* vol, WORD head_clus_num, DWORD id, DWORD* owner, const char* path, FILE* out) {
+    int count = 0;
+    WORD clus_num = head_clus_num;
+    while (clusNumIsData(vol, clus_num)) {
+        if (owner[clus_num]) {
+            if (owner[clus_num] == id) fprintf(out, "%s: chain loops back to cluster %u\n", path, clus_num);
+            else fprintf(out, "%s: cluster %u is also used by another entry\n", path, clus_num);
+            return -1;
+        }
+        owner[clus_num] = id;
+        ++count;
+        clus_num = getNextClusNumFromFAT(vol, clus_num);
+    }
+    if (!clusNumIsEOF(clus_num)) {
+        fprintf(out, "%s: chain ends with cluster number 0x%03x\n", path, clus_num);
+        return -1;
+    }
+    return count;
+}
+
+// a directory waiting to be checked
+typedef struct check_dir {
+    WORD    clus_num;
+    char*   path; // "" for root
+} check_dir;
+
+// count clusters allocated in FAT but not owned by any entry in `owner`
+static int countLostClus(const volume* vol, const DWORD* owner) {
+    int lost = 0;
+    lockAlloc(vol);
+    for (WORD clus_num = 2; clus_num < vol->clus_count; ++clus_num) {
+        WORD next = getNextClusNumFromFAT(vol, clus_num);
+        if (next != NOT_USED_CLUSTER_NUM && !clusNumIsBadClus(next) && !owner[clus_num]) ++lost;
+    }
+    unlockAlloc(vol);
+    return lost;
+}
+
+// directories are checked in breadth-first order, and only those with a sound chain are walked into,
+// so that a broken image could never make the walk loop
+// the volume is locked shared, and each directory is locked only while its entries and their chains are checked
+int checkVolume(const volume* vol, FILE* out) {
+    int problems = 0;
+    lockVolumeShared(vol);
+    lockAlloc(vol);
+    for (WORD clus_num = 2; clus_num < vol->clus_count; ++clus_num) {
+        WORD next = getNextClusNumFromFAT(vol, clus_num);
+        if (next != NOT_USED_CLUSTER_NUM && !clusNumIsData(vol, next) && !clusNumIsBadClus(next) && !clusNumIsEOF(next)) {
+            fprintf(out, "FAT: cluster %u is followed by invalid cluster number 0x%03x\n", clus_num, next);
+            ++problems;
+        }
+    }
+    unlockAlloc(vol);
+
+    // index (from 1) of the entry using each cluster, 0 if unused
+    DWORD* owner = (DWORD*)calloc(vol->clus_count, sizeof(DWORD));
+    DWORD id = 0;
+    size_t max_dirs = 16, dir_count = 0, k = 0;
+    check_dir* dirs = (check_dir*)malloc(sizeof(check_dir) * max_dirs);
+    int failed = !owner || !dirs;
+    if (!failed) {
+        dirs[0].clus_num = 0;
+        dirs[0].path = strdup("");
+        failed = !dirs[0].path;
+        if (!failed) dir_count = 1;
+    }
+    for (; !failed && k < dir_count; ++k) {
+        dir_iter it;
+        const file_entry* ents;
+        int count;
+        lockDir(vol, dirs[k].clus_num, 0);
+        dirIterInit(vol, &it, dirs[k].clus_num);
+        while (!failed && (ents = dirIterNext(vol, &it, &count, NULL, NULL))) {
+            ent_scan_mask mask;
+            scanEntries(ents, count, NULL, &mask);
+            for (DWORD live = mask.live & ~mask.vollab; live; live &= live - 1) {
+                const file_entry* ent = &ents[__builtin_ctz(live)];
+                // skip volumn label, self and last level directory
+                if (entIsDotOrDotDot(ent)) continue;
+                char name[13];
+                formatNameToNormal(ent->DIR_Name, name);
+                char* path = (char*)malloc(strlen(dirs[k].path) + 14);
+                if (!path) {
+                    failed = 1;
+                    break;
+                }
+                sprintf(path, "%s/%s", dirs[k].path, name);
+                int clus_total = ent->DIR_FstClus ? checkChain(vol, ent->DIR_FstClus, ++id, owner, path, out) : 0;
+                if (clus_total < 0) ++problems;
+                if (ent->DIR_Attr & FILE_ATTR_DIR) {
+                    if (!ent->DIR_FstClus) {
+                        fprintf(out, "%s: directory has no cluster\n", path);
+                        ++problems;
+                    }
+                    if (clus_total > 0) {
+                        if (dir_count == max_dirs) {
+                            check_dir* temp = (check_dir*)realloc(dirs, sizeof(check_dir) * max_dirs * 2);
+                            if (!temp) {
+                                free(path);
+                                failed = 1;
+                                break;
+                            }
+                            dirs = temp;
+                            max_dirs *= 2;
+                        }
+                        dirs[dir_count].clus_num = ent->DIR_FstClus;
+                        dirs[dir_count].path = path;
+                        ++dir_count;
+                        continue;
+                    }
+                } else {
+                    DWORD needed = ent->DIR_FileSize / vol->bytes_per_clus + (ent->DIR_FileSize % vol->bytes_per_clus != 0);
+                    // an empty file may hold one cluster or none, as `readFileContentByEnt` accepts
+                    int size_ok = (needed == 0) ? (clus_total <= 1) : ((DWORD)clus_total == needed);
+                    if (clus_total >= 0 && !size_ok) {
+                        fprintf(out, "%s: size %u needs %u clusters, but the chain has %d\n",
+                            path, ent->DIR_FileSize, needed, clus_total);
+                        ++problems;
+                    }
+                }
+                free(path);
+            }
+            if (mask.end) break; // empty, no more entries
+        }
+        unlockDir(vol, dirs[k].clus_num);
+        free(dirs[k].path);
+    }
+    // paths of directories not checked when failed
+    for (; k < dir_count; ++k) free(dirs[k].path);
+    free(dirs);
+
+    if (!failed) {
+        int lost = countLostClus(vol, owner);
+        if (lost) {
+            fprintf(out, "FAT: %d clusters are allocated but not used by any entry\n", lost);
+            ++problems;
+        }
+    }
+    free(owner);
+    unlockVolume(vol);
+    if (failed) {
+        fprintf(out, "Failed to alloc memory to check the volume.\n");
+        return -1;
+    }
+    return problems;
+}
+
+// write content of the file to `host_path`, return 1 when succeed else return 0
+static int exportFile(const volume* view, const file_entry* ent, const char* host_path) {
+    FILE* fp = fopen(host_path, "wb");
+    if (!fp) return 0;
+    BYTE* buf = (BYTE*)malloc(ent->DIR_FileSize ? ent->DIR_FileSize : 1);
+    int ok = buf && readFileContentByEnt(view, ent, buf);
+    if (ok) ok = fwrite(buf, 1, ent->DIR_FileSize, fp) == ent->DIR_FileSize;
+    free(buf);
+    return (fclose(fp) == 0) && ok;
+}
+
+// export the `k`th node of the tree and everything below it into `host_path`
+// a directory is created if not exists, and the others go on when one of them fails
+static int exportTreeNode(const volume* view, const ent_tree* tree, DWORD k, const char* host_path) {
+    const ent_tree_node* node = &tree->storage[k];
+    if (!(node->ent.DIR_Attr & FILE_ATTR_DIR)) return exportFile(view, &node->ent, host_path);
+    if (mkdir(host_path, 0777) != 0 && errno != EEXIST) return 0;
+    char* child_path = (char*)malloc(strlen(host_path) + 14);
+    if (!child_path) return 0;
+    int ok = 1;
+    for (DWORD i = node->first_child; i < node->first_child + node->child_count; ++i) {
+        char name[13];
+        formatNameToNormal(tree->storage[i].ent.DIR_Name, name);
+        sprintf(child_path, "%s/%s", host_path, name);
+        ok &= exportTreeNode(view, tree, i, child_path);
+    }
+    free(child_path);
+    return ok;
+}
+
+// everything is copied out of a snapshot, so that a slow host never blocks writers of the volume
+// return 1 when succeed else return 0
+int exportByPath(const volume* vol, const directory* dir, const char* path, const char* host_path) {
+    snapshot snap;
+    if (!openSnapshot(vol, &snap)) return 0;
+    ent_ref ref;
+    int ok = 0;
+    if (getFileEntRefByPath(&snap.view, dir->clus_num, path, &ref)) {
+        if (ref.ent.DIR_Attr & FILE_ATTR_DIR) {
+            // the view never changes, so the whole tree is read at once, by threads if it is large
+            ent_tree tree;
+            if (getEntTree(&snap.view, ref.ent.DIR_FstClus, &tree)) {
+                ok = exportTreeNode(&snap.view, &tree, 0, host_path);
+                entTreeDestroy(&tree);
+            }
+        }
+        else ok = exportFile(&snap.view, &ref.ent, host_path);
+    }
+    closeSnapshot(&snap);
+    return ok;
 }
 
 // free allocated memory
 void destroyDir(directory* dir) {
     free(dir->path_str);
-}
\ No newline at end of file
+}
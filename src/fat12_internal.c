@@ -1,20 +1,174 @@
+// for the writer-preferring kind of rwlock in glibc
+# ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+# endif
 # include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
 # include <ctype.h>
 # include <time.h>
+# include <unistd.h>
+# include <sched.h>
+# if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# endif
 # include "fat12.h"
 # include "fat12_internal.h"
 
 // to emulate the real way using BIOS
-void loadSectors(const floppy* disk, WORD logic_sec_num, WORD count, BYTE* buf) {
-    const fat12_header* const header = (const fat12_header* const)disk->storage;
-    memcpy(buf, disk->storage + logic_sec_num * header->BPB_BytesPerSec, header->BPB_BytesPerSec * count);
+void loadSectors(const volume* vol, WORD logic_sec_num, WORD count, BYTE* buf) {
+    size_t offset = logicSecToOffset(vol, logic_sec_num);
+    memcpy(buf, vol->disk->storage + offset, logicSecToOffset(vol, count));
 }
 
-void writeSectors(floppy* disk, WORD logic_sec_num, WORD count, const BYTE* buf) {
-    const fat12_header* const header = (const fat12_header* const)disk->storage;
-    memcpy(disk->storage + logic_sec_num * header->BPB_BytesPerSec, buf, header->BPB_BytesPerSec * count);
+void writeSectors(volume* vol, WORD logic_sec_num, WORD count, const BYTE* buf) {
+    size_t offset = logicSecToOffset(vol, logic_sec_num);
+    size_t len = logicSecToOffset(vol, count);
+    markDirty(vol->disk, offset, len);
+    memcpy(vol->disk->storage + offset, buf, len);
+}
+
+// keep units [first, last] in the newest version if they are changed for the first time since it was created
+static void saveUnitsForVersion(floppy* disk, size_t first, size_t last) {
+    pthread_mutex_lock(&disk->version_lock);
+    floppy_version* version = disk->newest_version;
+    for (size_t i = first; version && i <= last; ++i) {
+        if (version->saved[i]) continue;
+        BYTE* copy = version->units + i * DIRTY_UNIT_SIZE;
+        memcpy(copy, disk->storage + i * DIRTY_UNIT_SIZE, DIRTY_UNIT_SIZE);
+        __atomic_store_n(&version->saved[i], copy, __ATOMIC_RELEASE);
+        ++version->saved_count;
+    }
+    pthread_mutex_unlock(&disk->version_lock);
+    // the copies are published before any byte of the units is changed,
+    // so that a reader who sees a changed byte would find them (see `readFloppyVersion`)
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// record that bytes [offset, offset + len) of the image are going to be changed
+void markDirty(floppy* disk, size_t offset, size_t len) {
+    if (len == 0) return;
+    size_t first = offset / DIRTY_UNIT_SIZE;
+    size_t last = (offset + len - 1) / DIRTY_UNIT_SIZE;
+    for (size_t i = first; i <= last; ++i) {
+        // units sharing a byte may be marked by different threads
+        __atomic_fetch_or(&disk->dirty_map[i / 8], (BYTE)(1 << (i % 8)), __ATOMIC_RELAXED);
+    }
+    // versions are only added when no change is in progress, so it could be tested without the lock
+    if (__atomic_load_n(&disk->newest_version, __ATOMIC_ACQUIRE)) saveUnitsForVersion(disk, first, last);
+}
+
+static void freeFloppyVersion(floppy_version* version) {
+    free(version->units);
+    free(version);
+}
+
+// get the version of the image as it is now, which should be called when no change is in progress
+// return NULL if failed to alloc memory
+floppy_version* pinFloppyVersion(floppy* disk) {
+    pthread_mutex_lock(&disk->version_lock);
+    floppy_version* version = disk->newest_version;
+    // nothing has been changed since the newest version was created, so it could be shared
+    if (!version || version->saved_count > 0) {
+        version = (floppy_version*)calloc(1, sizeof(floppy_version));
+        if (version && !(version->units = (BYTE*)malloc(FLOPPY_SIZE))) {
+            free(version);
+            version = NULL;
+        }
+        if (version) {
+            if (disk->newest_version) __atomic_store_n(&disk->newest_version->next, version, __ATOMIC_RELEASE);
+            else disk->oldest_version = version;
+            __atomic_store_n(&disk->newest_version, version, __ATOMIC_RELEASE);
+        }
+    }
+    if (version) ++version->readers;
+    pthread_mutex_unlock(&disk->version_lock);
+    return version;
+}
+
+// release a version got from `pinFloppyVersion`, and free versions no snapshot reads any more
+void unpinFloppyVersion(floppy* disk, floppy_version* version) {
+    pthread_mutex_lock(&disk->version_lock);
+    --version->readers;
+    // a version is read by snapshots of it and of all older ones, so it is freed once they are all closed
+    while (disk->oldest_version && disk->oldest_version->readers == 0) {
+        floppy_version* oldest = disk->oldest_version;
+        disk->oldest_version = oldest->next;
+        if (!oldest->next) __atomic_store_n(&disk->newest_version, NULL, __ATOMIC_RELEASE);
+        freeFloppyVersion(oldest);
+    }
+    pthread_mutex_unlock(&disk->version_lock);
+}
+
+// the unit as it was in the version, which is kept by the version or a newer one
+// return NULL if it has not been changed since then
+static const BYTE* findSavedUnit(const floppy_version* version, size_t unit) {
+    for (const floppy_version* v = version; v; v = __atomic_load_n(&v->next, __ATOMIC_ACQUIRE)) {
+        const BYTE* saved = __atomic_load_n(&v->saved[unit], __ATOMIC_ACQUIRE);
+        if (saved) return saved;
+    }
+    return NULL;
+}
+
+// read bytes [offset, offset + len) of the image as they were in the version
+void readFloppyVersion(const floppy* disk, const floppy_version* version, size_t offset, size_t len, BYTE* buf) {
+    while (len > 0) {
+        size_t unit = offset / DIRTY_UNIT_SIZE;
+        size_t from = offset % DIRTY_UNIT_SIZE;
+        size_t size = DIRTY_UNIT_SIZE - from;
+        if (size > len) size = len;
+        const BYTE* saved = findSavedUnit(version, unit);
+        if (!saved) {
+            // a writer may change the unit while it is copied, which would have saved the unit first
+            // so test again after copying, in the same way as reading under a seqlock
+            memcpy(buf, disk->storage + offset, size);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            saved = findSavedUnit(version, unit);
+        }
+        if (saved) memcpy(buf, saved + from, size);
+        offset += size;
+        buf += size;
+        len -= size;
+    }
+}
+
+// free all versions, used when the floppy is destroyed
+void destroyFloppyVersions(floppy* disk) {
+    while (disk->oldest_version) {
+        floppy_version* oldest = disk->oldest_version;
+        disk->oldest_version = oldest->next;
+        freeFloppyVersion(oldest);
+    }
+    disk->newest_version = NULL;
+    pthread_mutex_destroy(&disk->version_lock);
+}
+
+// write all dirty units to the opened image file, merging adjacent units into one write
+// return 1 when success, else return 0
+int writeDirtyUnits(floppy* disk, int fd) {
+    size_t i = 0;
+    while (i < DIRTY_UNIT_COUNT) {
+        if (!disk->dirty_map[i / 8]) { // skip 8 clean units at once
+            i = (i / 8 + 1) * 8;
+            continue;
+        }
+        if (!(disk->dirty_map[i / 8] & (1 << (i % 8)))) {
+            ++i;
+            continue;
+        }
+        size_t first = i;
+        while (i < DIRTY_UNIT_COUNT && (disk->dirty_map[i / 8] & (1 << (i % 8)))) ++i;
+        size_t offset = first * DIRTY_UNIT_SIZE;
+        size_t len = (i - first) * DIRTY_UNIT_SIZE;
+        while (len > 0) {
+            ssize_t written = pwrite(fd, disk->storage + offset, len, offset);
+            if (written <= 0) return 0;
+            offset += written;
+            len -= written;
+        }
+    }
+    memset(disk->dirty_map, 0, sizeof(disk->dirty_map));
+    return 1;
 }
 
 // write the number to specific position of FAT12 record
@@ -44,11 +198,63 @@ WORD readFATAtPosition(const BYTE* FAT, WORD pos) {
     }
 }
 
-WORD getNextClusNumFromFAT(const floppy* disk, WORD clus_num) {
-    const fat12_header* const header = (const fat12_header* const)disk->storage;
-    // FAT1 is located at the second sector (which is after MBR sector)
-    const BYTE* FAT1 = disk->storage + header->BPB_BytesPerSec;
-    return readFATAtPosition(FAT1, clus_num);
+// return log2(n) if n is a power of 2, else return -1
+int log2OfPowerOf2(unsigned int n) {
+    if (n == 0 || (n & (n - 1))) return -1;
+    int shift = 0;
+    while ((1u << shift) != n) ++shift;
+    return shift;
+}
+
+// decode FAT1 into `vol->FAT`, return 1 when success, else return 0
+int loadFAT(volume* vol) {
+    // clusters are limited by both size of FAT and size of data area
+    int clus_count = (vol->secs_per_FAT * vol->bytes_per_sec) * 2 / 3; // divided by 1.5
+    int total_sectors = FLOPPY_SIZE / vol->bytes_per_sec;
+    int data_clusters = (total_sectors - vol->data_head_sec) / vol->sec_per_clus + 2;
+    if (data_clusters < clus_count) clus_count = data_clusters;
+    if (clus_count > EOF_CLUSTER_NUM) clus_count = EOF_CLUSTER_NUM;
+
+    const BYTE* FAT1 = vol->disk->storage + logicSecToOffset(vol, vol->FAT_head_sec);
+    vol->FAT = (WORD*)malloc(sizeof(WORD) * clus_count);
+    if (!vol->FAT) return 0;
+    for (int i = 0; i < clus_count; ++i) {
+        vol->FAT[i] = readFATAtPosition(FAT1, i);
+    }
+    vol->clus_count = clus_count;
+    vol->FAT_changed = 0;
+    return buildFreeExtents(vol);
+}
+
+// pack `vol->FAT` back into all FAT copies if it has been changed
+int flushFAT(volume* vol) {
+    if (!vol->FAT_changed) return 1;
+    int secs_per_FAT = vol->secs_per_FAT;
+    BYTE* FAT1 = (BYTE*)malloc(logicSecToOffset(vol, secs_per_FAT));
+    if (!FAT1) return 0;
+    // keep the bytes not covered by decoded entries unchanged
+    loadSectors(vol, vol->FAT_head_sec, secs_per_FAT, FAT1);
+    for (WORD i = 0; i < vol->clus_count; ++i) {
+        writeFATAtPosition(FAT1, i, vol->FAT[i]);
+    }
+    // write back, all FAT (usually FAT1 and FAT2) should be written
+    for (int i = 0; i < vol->num_FATs; ++i) {
+        writeSectors(vol, vol->FAT_head_sec + secs_per_FAT * i, secs_per_FAT, FAT1);
+    }
+    free(FAT1);
+    vol->FAT_changed = 0;
+    return 1;
+}
+
+WORD getNextClusNumFromFAT(const volume* vol, WORD clus_num) {
+    // a broken chain pointing out of the FAT is regarded as its end
+    if (clus_num >= vol->clus_count) return EOF_CLUSTER_NUM;
+    return vol->FAT[clus_num];
+}
+
+void setFATEntry(volume* vol, WORD clus_num, WORD num) {
+    vol->FAT[clus_num] = num;
+    vol->FAT_changed = 1;
 }
 
 void getWrtTimeFromFileEnt(
@@ -76,13 +282,13 @@ void setWrtTime(const struct tm* time, WORD* WrtTime, WORD* WrtDate) {
     *WrtDate = year | month | date;
 }
 
-void printFileEnt(const file_entry* ent) {
+void printFileEnt(FILE* out, const file_entry* ent) {
     char buffer[12];
     
     if (ent->DIR_Attr & FILE_ATTR_VOLLAB) {
         memcpy(buffer, ent->DIR_Name, 11);
         buffer[11] = '\0';
-        printf("VOLLAB:   %s\n", buffer);
+        fprintf(out, "VOLLAB:   %s\n", buffer);
         return;
     }
     // print attribute in formmat "drwahs"
@@ -98,23 +304,23 @@ void printFileEnt(const file_entry* ent) {
     buffer[4] = (ent->DIR_Attr & FILE_ATTR_HIDDEN) ? 'h' : '-';
     buffer[5] = (ent->DIR_Attr & FILE_ATTR_SYSTEM) ? 's' : '-';
     buffer[6] = '\0';
-    printf("%s    ", buffer);
+    fprintf(out, "%s    ", buffer);
     // print name
     memcpy(buffer, ent->DIR_Name, 8);
     buffer[8] = '\0';
-    printf("%s ", buffer);
+    fprintf(out, "%s ", buffer);
     // print type
     memcpy(buffer, ent->DIR_Name + 8, 3);
     buffer[3] = '\0';
-    printf("%s ", buffer);
+    fprintf(out, "%s ", buffer);
     // print file length
-    printf("%9d ", ent->DIR_FileSize);
+    fprintf(out, "%9d ", ent->DIR_FileSize);
     // print last changed time
     int year, month, date, hour, minute, second;
     getWrtTimeFromFileEnt(
         ent, &year, &month, &date, 
         &hour, &minute, &second);
-    printf("%4d-%02d-%02d %02d:%02d:%02d\n", year, month, date, 
+    fprintf(out, "%4d-%02d-%02d %02d:%02d:%02d\n", year, month, date, 
         hour, minute, second);
 }
 
@@ -122,20 +328,23 @@ void printFileEnt(const file_entry* ent) {
 
 void fileVectorInit(file_vector* p) {
     p->storage=(file_entry*)malloc(sizeof(file_entry) * 2);
-    p->max_size = 2;
+    p->max_size = p->storage ? 2 : 0;
     p->size = 0;
 }
 
-void fileVectorAppend(file_vector* p, const file_entry* ent) {
+int fileVectorAppend(file_vector* p, const file_entry* ent) {
     if (p->size == p->max_size) {
-        file_entry* temp = (file_entry*)malloc(sizeof(file_entry) * (p->max_size * 2));
-        memcpy(temp, p->storage, sizeof(file_entry) * p->max_size);
+        int max_size = p->max_size ? p->max_size * 2 : 2;
+        file_entry* temp = (file_entry*)malloc(sizeof(file_entry) * max_size);
+        if (!temp) return 0;
+        memcpy(temp, p->storage, sizeof(file_entry) * p->size);
         free(p->storage);
         p->storage = temp;
-        p->max_size *= 2;
+        p->max_size = max_size;
     }
     memcpy(p->storage + p->size, ent, sizeof(file_entry));
     ++p->size;
+    return 1;
 }
 
 void fileVectorDestroy(file_vector* p) {
@@ -216,327 +425,1374 @@ void formatNameToFATType(const char* name, BYTE* buffer) {
     memcpy(buffer + 8, file_ext, 3);
 }
 
-// ----------- a simple completement of tree -----------
+// ----------- a flattened tree of entries -----------
 
 void entTreeInit(ent_tree* p) {
-    p->storage = (ent_tree_node*)malloc(sizeof(ent_tree_node) * 2);
-    p->max_size = 2;
+    p->storage = (ent_tree_node*)malloc(sizeof(ent_tree_node) * 16);
+    p->max_size = p->storage ? 16 : 0;
     p->size = 0;
 }
 
-void entTreeAppend(ent_tree* p, const file_entry* ent, void* sub_tree) {
-    if (p->size == p->max_size) {
-        ent_tree_node* temp = (ent_tree_node*)malloc(sizeof(ent_tree_node) * (p->max_size * 2));
-        memcpy(temp, p->storage, sizeof(ent_tree_node) * p->max_size);
-        free(p->storage);
-        p->storage = temp;
-        p->max_size *= 2;
-    }
-    memcpy(&(p->storage + p->size)->ent, ent, sizeof(file_entry));
-    (p->storage + p->size)->sub_tree = sub_tree;
+int entTreeAppend(ent_tree* p, const file_entry* ent) {
+    if (p->size == p->max_size && !entTreeReserve(p, p->max_size ? p->max_size * 2 : 16)) return 0;
+    ent_tree_node* node = &p->storage[p->size];
+    memcpy(&node->ent, ent, sizeof(file_entry));
+    node->first_child = 0;
+    node->child_count = 0;
     ++p->size;
+    return 1;
 }
 
-int entTreeNodeCmp(const void* x, const void* y) { // use to sort
-    const ent_tree_node* a = (const ent_tree_node*)x;
-    const ent_tree_node* b = (const ent_tree_node*)y;
-    return fileEntCmp(&a->ent, &b->ent);
+int entTreeReserve(ent_tree* p, DWORD size) {
+    if (size <= p->max_size) return 1;
+    ent_tree_node* temp = (ent_tree_node*)realloc(p->storage, sizeof(ent_tree_node) * size);
+    if (!temp) return 0;
+    p->storage = temp;
+    p->max_size = size;
+    return 1;
 }
 
 void entTreeDestroy(ent_tree* p) {
-    for (size_t i = 0; i < p->size; ++i) {
-        if (p->storage[i].sub_tree != NULL) entTreeDestroy((ent_tree*)p->storage[i].sub_tree);
-    }
     free(p->storage);
-    free(p);
 }
 
 // ----------- ----------------------------- -----------
 
-// the pointer returned by this function should be destroyed by function `entTreeDestroy`
-ent_tree* getEntTree(const floppy* disk, WORD dir_clus_num) {
-    const fat12_header* header = (const fat12_header*)disk->storage;
+// ----------- scanning entries of directory -----------
+
+// set bits of entries [from, count) in masks before `finishScanMask`, where `end` has all empty ones
+static inline void scanEntriesScalar(const file_entry* ents, int from, int count, const BYTE* name,
+                                     ent_scan_mask* mask) {
+    for (int i = from; i < count; ++i) {
+        const file_entry* ent = &ents[i];
+        if (ent->DIR_Name[0] == 0x00) mask->end |= 1u << i;
+        if (ent->DIR_Name[0] == FILE_DEL_BYTE) mask->deleted |= 1u << i;
+        if (ent->DIR_Attr & FILE_ATTR_DIR) mask->dir |= 1u << i;
+        if (ent->DIR_Attr & FILE_ATTR_VOLLAB) mask->vollab |= 1u << i;
+        if (name && !memcmp(ent->DIR_Name, name, 11)) mask->match |= 1u << i;
+    }
+}
 
-    int sec_per_clus = header->BPB_SecPerClus;
-    int bytes_per_clus = sec_per_clus * header->BPB_BytesPerSec;
-    // assume bytes_per_clus is a multiple of sizeof(file_entry)
-    int entries_per_clus = bytes_per_clus / sizeof(file_entry);
+# if defined(__x86_64__) || defined(__i386__)
+
+// the 11-byte name and the attribute are the first 3 dwords of an entry, kernels below compare
+// the dwords of several entries at once. The first byte of name is the low byte of dword 0,
+// and the attribute is the high byte of dword 2
+
+__attribute__((target("sse2")))
+static void scanEntriesSSE2(const file_entry* ents, int count, const BYTE* name, ent_scan_mask* mask) {
+    DWORD name_dw[3] = { 0, 0, 0 };
+    if (name) memcpy(name_dw, name, 11);
+    const __m128i n0 = _mm_set1_epi32(name_dw[0]);
+    const __m128i n1 = _mm_set1_epi32(name_dw[1]);
+    const __m128i n2 = _mm_set1_epi32(name_dw[2]);
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    const __m128i name_tail = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i del_byte = _mm_set1_epi32(FILE_DEL_BYTE);
+    const __m128i attr_dir = _mm_set1_epi32(FILE_ATTR_DIR << 24);
+    const __m128i attr_vollab = _mm_set1_epi32(FILE_ATTR_VOLLAB << 24);
+    const __m128i zero = _mm_setzero_si128();
 
-    int FAT_sectors = header->BPB_NumFATs * header->BPB_FATSz16;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // transpose the first 4 dwords of 4 entries, so that `w0` has dword 0 of each entry and so on
+        __m128i a = _mm_loadu_si128((const __m128i*)&ents[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&ents[i + 1]);
+        __m128i c = _mm_loadu_si128((const __m128i*)&ents[i + 2]);
+        __m128i d = _mm_loadu_si128((const __m128i*)&ents[i + 3]);
+        __m128i ab_lo = _mm_unpacklo_epi32(a, b), ab_hi = _mm_unpackhi_epi32(a, b);
+        __m128i cd_lo = _mm_unpacklo_epi32(c, d), cd_hi = _mm_unpackhi_epi32(c, d);
+        __m128i w0 = _mm_unpacklo_epi64(ab_lo, cd_lo);
+        __m128i w1 = _mm_unpackhi_epi64(ab_lo, cd_lo);
+        __m128i w2 = _mm_unpacklo_epi64(ab_hi, cd_hi);
+
+        __m128i first = _mm_and_si128(w0, low_byte);
+        mask->end |= (DWORD)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, zero))) << i;
+        mask->deleted |= (DWORD)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, del_byte))) << i;
+        mask->dir |= (DWORD)_mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpeq_epi32(_mm_and_si128(w2, attr_dir), attr_dir))) << i;
+        mask->vollab |= (DWORD)_mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpeq_epi32(_mm_and_si128(w2, attr_vollab), attr_vollab))) << i;
+        if (name) {
+            __m128i eq = _mm_and_si128(_mm_cmpeq_epi32(w0, n0), _mm_cmpeq_epi32(w1, n1));
+            eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_and_si128(w2, name_tail), n2));
+            mask->match |= (DWORD)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+        }
+    }
+    scanEntriesScalar(ents, i, count, name, mask);
+}
 
-    BYTE* now_clus = (BYTE*)malloc(bytes_per_clus);
-    ent_tree* tree = (ent_tree*)malloc(sizeof(ent_tree));
-    entTreeInit(tree);
-    char buffer[13];
-    if (dir_clus_num == 0) {
-        // now in root directory
-        int root_head_sec = 1 + FAT_sectors;
-        int max_root_entries = header->BPB_RootEntCnt;
-
-        loadSectors(disk, root_head_sec, sec_per_clus, now_clus);
-        int total = 0, i = 0;
-        while (total < max_root_entries) {
-            const file_entry* ent = &((const file_entry*)now_clus)[i];
-
-            if (*(const BYTE*)ent == 0x00) break; // empty
-            else if (*(const BYTE*)ent != FILE_DEL_BYTE) {
-                formatNameToNormal(ent->DIR_Name, buffer);
-                if (!(ent->DIR_Attr & FILE_ATTR_VOLLAB)) {
-                    // skip volumn label, self and last level directory
-                    ent_tree* sub_tree = NULL;
-                    if (ent->DIR_Attr & FILE_ATTR_DIR) {
-                        sub_tree = getEntTree(disk, ent->DIR_FstClus);
-                    }
-                    entTreeAppend(tree, ent, sub_tree);
-                }
+__attribute__((target("avx2")))
+static void scanEntriesAVX2(const file_entry* ents, int count, const BYTE* name, ent_scan_mask* mask) {
+    DWORD name_dw[3] = { 0, 0, 0 };
+    if (name) memcpy(name_dw, name, 11);
+    const __m256i n0 = _mm256_set1_epi32(name_dw[0]);
+    const __m256i n1 = _mm256_set1_epi32(name_dw[1]);
+    const __m256i n2 = _mm256_set1_epi32(name_dw[2]);
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i name_tail = _mm256_set1_epi32(0x00FFFFFF);
+    const __m256i del_byte = _mm256_set1_epi32(FILE_DEL_BYTE);
+    const __m256i attr_dir = _mm256_set1_epi32(FILE_ATTR_DIR << 24);
+    const __m256i attr_vollab = _mm256_set1_epi32(FILE_ATTR_VOLLAB << 24);
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        // the same transposing as SSE2, on entries i..i+3 in low lanes and i+4..i+7 in high lanes
+        __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)&ents[i])), _mm_loadu_si128((const __m128i*)&ents[i + 4]), 1);
+        __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)&ents[i + 1])), _mm_loadu_si128((const __m128i*)&ents[i + 5]), 1);
+        __m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)&ents[i + 2])), _mm_loadu_si128((const __m128i*)&ents[i + 6]), 1);
+        __m256i d = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)&ents[i + 3])), _mm_loadu_si128((const __m128i*)&ents[i + 7]), 1);
+        __m256i ab_lo = _mm256_unpacklo_epi32(a, b), ab_hi = _mm256_unpackhi_epi32(a, b);
+        __m256i cd_lo = _mm256_unpacklo_epi32(c, d), cd_hi = _mm256_unpackhi_epi32(c, d);
+        __m256i w0 = _mm256_unpacklo_epi64(ab_lo, cd_lo);
+        __m256i w1 = _mm256_unpackhi_epi64(ab_lo, cd_lo);
+        __m256i w2 = _mm256_unpacklo_epi64(ab_hi, cd_hi);
+
+        __m256i first = _mm256_and_si256(w0, low_byte);
+        mask->end |= (DWORD)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first, zero))) << i;
+        mask->deleted |= (DWORD)_mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(first, del_byte))) << i;
+        mask->dir |= (DWORD)_mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(_mm256_and_si256(w2, attr_dir), attr_dir))) << i;
+        mask->vollab |= (DWORD)_mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(_mm256_and_si256(w2, attr_vollab), attr_vollab))) << i;
+        if (name) {
+            __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi32(w0, n0), _mm256_cmpeq_epi32(w1, n1));
+            eq = _mm256_and_si256(eq, _mm256_cmpeq_epi32(_mm256_and_si256(w2, name_tail), n2));
+            mask->match |= (DWORD)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << i;
+        }
+    }
+    scanEntriesScalar(ents, i, count, name, mask);
+}
+
+# endif
+
+// scan `count` (no more than `SCAN_MAX_ENTRIES`) entries at once
+// `name` is the 11-byte FAT name to match, or NULL if `match` is not needed
+void scanEntries(const file_entry* ents, int count, const BYTE* name, ent_scan_mask* mask) {
+    memset(mask, 0, sizeof(ent_scan_mask));
+# if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) scanEntriesAVX2(ents, count, name, mask);
+    else if (__builtin_cpu_supports("sse2")) scanEntriesSSE2(ents, count, name, mask);
+    else scanEntriesScalar(ents, 0, count, name, mask);
+# else
+    scanEntriesScalar(ents, 0, count, name, mask);
+# endif
+    // entries after the first empty one are not in any mask
+    DWORD valid = (count >= 32) ? 0xFFFFFFFFu : (1u << count) - 1;
+    DWORD empty = mask->end & valid;
+    mask->end = empty & (~empty + 1); // the lowest bit
+    DWORD before_end = mask->end ? mask->end - 1 : valid;
+    mask->deleted &= before_end;
+    mask->live = before_end & ~mask->deleted;
+    mask->dir &= mask->live;
+    mask->vollab &= mask->live;
+    mask->match &= mask->live;
+}
+
+void dirIterInit(const volume* vol, dir_iter* it, WORD dir_clus_num) {
+    it->dir_clus_num = dir_clus_num;
+    it->clus_num = dir_clus_num;
+    it->logic_sec_num = (dir_clus_num == 0) ? vol->root_head_sec : clusToLogicSec(vol, dir_clus_num);
+    it->sec_in_clus = 0;
+    it->slot = 0;
+    it->ent_num = 0;
+    it->done = (dir_clus_num != 0 && !clusNumIsData(vol, dir_clus_num));
+}
+
+// return entries of the next step in the image, and set `*count` as number of them
+// `*loc` is set as location of the first one, `*clus_num` is set as cluster of them (if not NULL)
+// return NULL when there are no more entries
+const file_entry* dirIterNext(const volume* vol, dir_iter* it, int* count, ent_loc* loc, WORD* clus_num) {
+    if (it->done) return NULL;
+    int entries_per_sec = vol->bytes_per_sec / sizeof(file_entry);
+    int n = entries_per_sec - it->slot;
+    if (n > SCAN_MAX_ENTRIES) n = SCAN_MAX_ENTRIES;
+    if (it->dir_clus_num == 0 && vol->max_root_entries - it->ent_num < (DWORD)n) {
+        n = vol->max_root_entries - it->ent_num;
+    }
+    if (n <= 0) {
+        it->done = 1;
+        return NULL;
+    }
+    const file_entry* ents;
+    size_t offset = logicSecToOffset(vol, it->logic_sec_num) + it->slot * sizeof(file_entry);
+    if (vol->version) {
+        // entries of a snapshot are copied out, as the image may be changed while they are used
+        readFloppyVersion(vol->disk, vol->version, offset, n * sizeof(file_entry), (BYTE*)it->buf);
+        ents = it->buf;
+    } else {
+        ents = (const file_entry*)(vol->disk->storage + offset);
+    }
+    *count = n;
+    if (loc) {
+        loc->logic_sec_num = it->logic_sec_num;
+        loc->slot = it->slot;
+        loc->ent_num = it->ent_num;
+    }
+    if (clus_num) *clus_num = it->clus_num;
+    // move to the next step
+    it->ent_num += n;
+    it->slot += n;
+    if (it->slot >= entries_per_sec) {
+        it->slot = 0;
+        ++it->logic_sec_num;
+        if (it->dir_clus_num == 0) {
+            // root directory is continuous
+            if (it->ent_num >= vol->max_root_entries) it->done = 1;
+        } else if (++it->sec_in_clus >= vol->sec_per_clus) {
+            it->sec_in_clus = 0;
+            it->clus_num = getNextClusNumFromFAT(vol, it->clus_num);
+            if (clusNumIsData(vol, it->clus_num)) it->logic_sec_num = clusToLogicSec(vol, it->clus_num);
+            else it->done = 1;
+            // a chain longer than the number of clusters must be looped in a broken FAT
+            if (it->ent_num >= (DWORD)vol->clus_count * vol->entries_per_clus) it->done = 1;
+        }
+    }
+    return ents;
+}
+
+// ----------- ------------------------------ -----------
+
+// ----------- walking a directory tree in parallel -----------
+
+# define WALK_BLOCK_SIZE 65536
+
+typedef struct walk_block {
+    struct walk_block* next;
+    size_t used;
+    size_t size;
+    // followed by `size` bytes
+} walk_block;
+
+// directories waiting to be visited by a thread, which takes the newest one itself
+// while other threads steal the oldest one, that is the one most likely to have a large subtree
+typedef struct walk_deque {
+    pthread_mutex_t lock;
+    walk_dir** tasks;
+    int head; // the oldest
+    int tail; // after the newest
+    int max_size;
+} walk_deque;
+
+typedef struct walk_state {
+    const volume* vol;
+    dir_walk* walk;
+    walk_deque deques[WALK_MAX_WORKERS];
+    int worker_count;
+    // the visit of the directory starting at each cluster, so that a directory reached again
+    // in a broken image is not visited twice
+    walk_dir** owners;
+    // directories waiting or being visited, the walk ends when it drops to 0
+    int pending;
+    int failed;
+} walk_state;
+
+// what a thread keeps for itself while walking
+typedef struct walk_worker {
+    walk_state* st;
+    int index;
+    file_vector children; // entries of the directory being visited
+    DWORD dir_count;
+    DWORD ent_count;
+} walk_worker;
+
+// take `size` bytes from blocks of a thread, return NULL if failed to alloc memory
+static void* walkAlloc(walk_block** blocks, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    walk_block* block = *blocks;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > WALK_BLOCK_SIZE ? size : WALK_BLOCK_SIZE;
+        block = (walk_block*)malloc(sizeof(walk_block) + block_size);
+        if (!block) return NULL;
+        block->next = *blocks;
+        block->used = 0;
+        block->size = block_size;
+        *blocks = block;
+    }
+    void* ptr = (BYTE*)(block + 1) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+// push a directory to the deque, return 1 when success, else return 0 (failed to alloc memory)
+static int walkPush(walk_deque* q, walk_dir* dir) {
+    int success = 1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head == q->tail) q->head = q->tail = 0;
+    if (q->tail == q->max_size) {
+        int max_size = q->max_size ? q->max_size * 2 : 64;
+        walk_dir** tasks = (walk_dir**)realloc(q->tasks, sizeof(walk_dir*) * max_size);
+        if (tasks) {
+            q->tasks = tasks;
+            q->max_size = max_size;
+        }
+    }
+    if (q->tail < q->max_size) q->tasks[q->tail++] = dir;
+    else success = 0;
+    pthread_mutex_unlock(&q->lock);
+    return success;
+}
+
+// take the newest directory of its own, or steal the oldest one of others, return NULL if there is none
+static walk_dir* walkTake(walk_state* st, int index) {
+    walk_dir* dir = NULL;
+    for (int i = 0; i < st->worker_count && !dir; ++i) {
+        walk_deque* q = &st->deques[(index + i) % st->worker_count];
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head) dir = (i == 0) ? q->tasks[--q->tail] : q->tasks[q->head++];
+        pthread_mutex_unlock(&q->lock);
+    }
+    return dir;
+}
+
+// keep children of the directory and push directories in them as new tasks
+static void walkVisit(walk_worker* worker, walk_dir* dir) {
+    walk_state* st = worker->st;
+    walk_block** blocks = &st->walk->blocks[worker->index];
+    file_vector* children = &worker->children;
+    DWORD subdir_count = 0;
+    children->size = 0;
+    dir_iter it;
+    const file_entry* ents;
+    int count;
+    dirIterInit(st->vol, &it, dir->ent.DIR_FstClus);
+    while ((ents = dirIterNext(st->vol, &it, &count, NULL, NULL))) {
+        ent_scan_mask mask;
+        scanEntries(ents, count, NULL, &mask);
+        for (DWORD live = mask.live & ~mask.vollab; live; live &= live - 1) {
+            const file_entry* ent = &ents[__builtin_ctz(live)];
+            // skip volumn label, self and last level directory
+            if (entIsDotOrDotDot(ent)) continue;
+            if (!fileVectorAppend(children, ent)) {
+                __atomic_store_n(&st->failed, 1, __ATOMIC_RELAXED);
+                return;
             }
+            if (ent->DIR_Attr & FILE_ATTR_DIR) ++subdir_count;
+        }
+        if (mask.end) break; // empty, no more entries
+    }
+    dir->children = (file_entry*)walkAlloc(blocks, sizeof(file_entry) * children->size);
+    dir->subdirs = (walk_dir**)walkAlloc(blocks, sizeof(walk_dir*) * subdir_count);
+    if (!dir->children || !dir->subdirs) {
+        __atomic_store_n(&st->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(dir->children, children->storage, sizeof(file_entry) * children->size);
+    dir->child_count = children->size;
+    dir->subdir_count = 0;
+    for (DWORD i = 0; i < dir->child_count; ++i) {
+        if (!(dir->children[i].DIR_Attr & FILE_ATTR_DIR)) continue;
+        walk_dir* sub = (walk_dir*)walkAlloc(blocks, sizeof(walk_dir));
+        if (!sub) {
+            __atomic_store_n(&st->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        memset(sub, 0, sizeof(walk_dir));
+        sub->ent = dir->children[i];
+        // the first one reaching a directory visits it, and others share the visit
+        WORD clus_num = sub->ent.DIR_FstClus;
+        walk_dir* owner = NULL;
+        if (clus_num < st->vol->clus_count && !__atomic_compare_exchange_n(&st->owners[clus_num], &owner, sub,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            dir->subdirs[dir->subdir_count++] = owner;
+            continue;
+        }
+        dir->subdirs[dir->subdir_count++] = sub;
+        ++worker->dir_count;
+        // the directory being visited is still pending, so `pending` never drops to 0 too early
+        __atomic_fetch_add(&st->pending, 1, __ATOMIC_RELAXED);
+        if (!walkPush(&st->deques[worker->index], sub)) {
+            __atomic_store_n(&st->failed, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&st->pending, 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    worker->ent_count += dir->child_count;
+}
 
-            ++total;
-            ++i;
-            if (i >= entries_per_clus) {
-                int offset = (total/entries_per_clus) * sec_per_clus;
-                loadSectors(disk, root_head_sec + offset, sec_per_clus, now_clus);
+// visit directories until no one is waiting or being visited by any thread
+static void* walkRun(void* arg) {
+    walk_worker* worker = (walk_worker*)arg;
+    walk_state* st = worker->st;
+    while (__atomic_load_n(&st->pending, __ATOMIC_ACQUIRE) > 0) {
+        walk_dir* dir = walkTake(st, worker->index);
+        if (!dir) { // others are visiting the last directories, which may push more
+            sched_yield();
+            continue;
+        }
+        walkVisit(worker, dir);
+        __atomic_fetch_sub(&st->pending, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// number of CPUs the process may run on, which is got once as it takes a few system calls
+int usableCpuCount(void) {
+    static int cpu_count = 0;
+    int count = __atomic_load_n(&cpu_count, __ATOMIC_RELAXED);
+    if (count == 0) {
+        // CPUs the process may run on, which may be fewer than those online
+        cpu_set_t cpus;
+        long online = (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+            ? CPU_COUNT(&cpus) : sysconf(_SC_NPROCESSORS_ONLN);
+        count = online < 1 ? 1 : (int)online;
+        __atomic_store_n(&cpu_count, count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+// number of threads which could walk a tree at once
+int walkWorkerCount(void) {
+    int count = usableCpuCount();
+    return count > WALK_MAX_WORKERS ? WALK_MAX_WORKERS : count;
+}
+
+// visit the directories and everything in them, each directory is a task run by one of the threads
+// return 1 when success, else return 0 (failed to alloc memory)
+int walkDirTrees(const volume* vol, const file_entry* tops, DWORD top_count, dir_walk* walk) {
+    memset(walk, 0, sizeof(dir_walk));
+    walk->tops = (walk_dir*)walkAlloc(&walk->blocks[0], sizeof(walk_dir) * top_count);
+    if (!walk->tops) return 0;
+    walk->top_count = top_count;
+    walk->dir_count = top_count;
+
+    walk_state st;
+    st.vol = vol;
+    st.walk = walk;
+    st.worker_count = walkWorkerCount();
+    st.owners = (walk_dir**)calloc(vol->clus_count, sizeof(walk_dir*));
+    if (!st.owners) {
+        dirWalkDestroy(walk);
+        return 0;
+    }
+    st.pending = top_count;
+    st.failed = 0;
+    walk_worker workers[WALK_MAX_WORKERS];
+    for (int i = 0; i < st.worker_count; ++i) {
+        pthread_mutex_init(&st.deques[i].lock, NULL);
+        st.deques[i].tasks = NULL;
+        st.deques[i].head = st.deques[i].tail = st.deques[i].max_size = 0;
+        workers[i].st = &st;
+        workers[i].index = i;
+        fileVectorInit(&workers[i].children);
+        workers[i].dir_count = 0;
+        workers[i].ent_count = 0;
+    }
+    // deal the tops to all threads at first, and they steal from each other once their own run out
+    for (DWORD i = 0; i < top_count; ++i) {
+        walk_dir* top = &walk->tops[i];
+        memset(top, 0, sizeof(walk_dir));
+        top->ent = tops[i];
+        WORD clus_num = top->ent.DIR_FstClus;
+        if (clus_num < vol->clus_count && !st.owners[clus_num]) st.owners[clus_num] = top;
+        if (!walkPush(&st.deques[i % st.worker_count], top)) {
+            st.failed = 1;
+            st.pending = 0;
+        }
+    }
+    pthread_t threads[WALK_MAX_WORKERS];
+    int started = 0;
+    for (int i = 1; i < st.worker_count; ++i) {
+        if (pthread_create(&threads[started], NULL, walkRun, &workers[i]) != 0) break;
+        ++started;
+    }
+    // deques of threads failed to start are stolen by others
+    walkRun(&workers[0]);
+    for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < st.worker_count; ++i) {
+        walk->dir_count += workers[i].dir_count;
+        walk->ent_count += workers[i].ent_count;
+        fileVectorDestroy(&workers[i].children);
+        pthread_mutex_destroy(&st.deques[i].lock);
+        free(st.deques[i].tasks);
+    }
+    free(st.owners);
+    if (st.failed) {
+        dirWalkDestroy(walk);
+        return 0;
+    }
+    return 1;
+}
+
+void dirWalkDestroy(dir_walk* walk) {
+    for (int i = 0; i < WALK_MAX_WORKERS; ++i) {
+        while (walk->blocks[i]) {
+            walk_block* next = walk->blocks[i]->next;
+            free(walk->blocks[i]);
+            walk->blocks[i] = next;
+        }
+    }
+    walk->tops = NULL;
+}
+
+// ----------- ------------------------------------ -----------
+
+// ----------- locks of a volume -----------
+
+// locks are changed through a const volume, as reading needs them as well
+# define volumeOf(vol) ((volume*)(vol))
+
+void initVolumeLocks(volume* vol) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+# ifdef __GLIBC__
+    // rwlocks of glibc prefer readers by default, so that readers coming one after another could
+    // block a writer forever. No read lock is taken twice by a thread, so preferring writers is safe
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+# endif
+    pthread_rwlock_init(&vol->ns_lock, &attr);
+    for (int i = 0; i < DIR_LOCK_COUNT; ++i) {
+        pthread_rwlock_init(&vol->dir_locks[i], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&vol->alloc_lock, NULL);
+    pthread_mutex_init(&vol->index_lock, NULL);
+}
+
+void destroyVolumeLocks(volume* vol) {
+    pthread_rwlock_destroy(&vol->ns_lock);
+    for (int i = 0; i < DIR_LOCK_COUNT; ++i) {
+        pthread_rwlock_destroy(&vol->dir_locks[i]);
+    }
+    pthread_mutex_destroy(&vol->alloc_lock);
+    pthread_mutex_destroy(&vol->index_lock);
+}
+
+void lockVolumeShared(const volume* vol) {
+    pthread_rwlock_rdlock(&volumeOf(vol)->ns_lock);
+}
+
+void lockVolumeExclusive(const volume* vol) {
+    pthread_rwlock_wrlock(&volumeOf(vol)->ns_lock);
+}
+
+void unlockVolume(const volume* vol) {
+    pthread_rwlock_unlock(&volumeOf(vol)->ns_lock);
+}
+
+void dirLockSetInit(dir_lock_set* set) {
+    set->count = 0;
+}
+
+void dirLockSetAdd(dir_lock_set* set, WORD dir_clus_num, int write) {
+    WORD stripe = dir_clus_num % DIR_LOCK_COUNT;
+    for (int i = 0; i < set->count; ++i) {
+        if (set->stripes[i] == stripe) { // locked once, for write if either wants
+            set->write[i] |= write;
+            return;
+        }
+    }
+    set->stripes[set->count] = stripe;
+    set->write[set->count] = write;
+    ++set->count;
+}
+
+void lockDirs(const volume* vol, dir_lock_set* set) {
+    // insertion sort, there are only a few of them
+    for (int i = 1; i < set->count; ++i) {
+        WORD stripe = set->stripes[i];
+        int write = set->write[i];
+        int j = i;
+        for (; j > 0 && set->stripes[j - 1] > stripe; --j) {
+            set->stripes[j] = set->stripes[j - 1];
+            set->write[j] = set->write[j - 1];
+        }
+        set->stripes[j] = stripe;
+        set->write[j] = write;
+    }
+    for (int i = 0; i < set->count; ++i) {
+        pthread_rwlock_t* lock = &volumeOf(vol)->dir_locks[set->stripes[i]];
+        if (set->write[i]) pthread_rwlock_wrlock(lock);
+        else pthread_rwlock_rdlock(lock);
+    }
+}
+
+void unlockDirs(const volume* vol, const dir_lock_set* set) {
+    for (int i = set->count - 1; i >= 0; --i) {
+        pthread_rwlock_unlock(&volumeOf(vol)->dir_locks[set->stripes[i]]);
+    }
+}
+
+void lockDir(const volume* vol, WORD dir_clus_num, int write) {
+    pthread_rwlock_t* lock = &volumeOf(vol)->dir_locks[dir_clus_num % DIR_LOCK_COUNT];
+    if (write) pthread_rwlock_wrlock(lock);
+    else pthread_rwlock_rdlock(lock);
+}
+
+void unlockDir(const volume* vol, WORD dir_clus_num) {
+    pthread_rwlock_unlock(&volumeOf(vol)->dir_locks[dir_clus_num % DIR_LOCK_COUNT]);
+}
+
+void lockAlloc(const volume* vol) {
+    pthread_mutex_lock(&volumeOf(vol)->alloc_lock);
+}
+
+void unlockAlloc(const volume* vol) {
+    pthread_mutex_unlock(&volumeOf(vol)->alloc_lock);
+}
+
+// ----------- ---------------------- -----------
+
+// ----------- snapshots of a volume -----------
+
+// open a snapshot after operations in progress finish, return 1 when success, else return 0
+int openSnapshot(const volume* vol, snapshot* snap) {
+    volume* view = &snap->view;
+    lockVolumeExclusive(vol);
+    // only the geometry is taken, the view has its own locks and no index or free extents
+    memset(view, 0, sizeof(volume));
+    view->disk = vol->disk;
+    view->bytes_per_sec = vol->bytes_per_sec;
+    view->sec_per_clus = vol->sec_per_clus;
+    view->bytes_per_clus = vol->bytes_per_clus;
+    view->entries_per_clus = vol->entries_per_clus;
+    view->bytes_per_sec_shift = vol->bytes_per_sec_shift;
+    view->sec_per_clus_shift = vol->sec_per_clus_shift;
+    view->bytes_per_clus_shift = vol->bytes_per_clus_shift;
+    view->num_FATs = vol->num_FATs;
+    view->secs_per_FAT = vol->secs_per_FAT;
+    view->FAT_head_sec = vol->FAT_head_sec;
+    view->root_head_sec = vol->root_head_sec;
+    view->root_sectors = vol->root_sectors;
+    view->max_root_entries = vol->max_root_entries;
+    view->data_head_sec = vol->data_head_sec;
+    view->clus_count = vol->clus_count;
+    // the decoded FAT is small, so it is copied instead of being versioned
+    view->FAT = (WORD*)malloc(sizeof(WORD) * vol->clus_count);
+    if (view->FAT) {
+        memcpy(view->FAT, vol->FAT, sizeof(WORD) * vol->clus_count);
+        view->version = pinFloppyVersion(vol->disk);
+    }
+    unlockVolume(vol);
+    if (!view->FAT || !view->version) {
+        free(view->FAT);
+        view->FAT = NULL;
+        return 0;
+    }
+    initVolumeLocks(view);
+    return 1;
+}
+
+void closeSnapshot(snapshot* snap) {
+    destroyVolumeLocks(&snap->view);
+    unpinFloppyVersion(snap->view.disk, snap->view.version);
+    free(snap->view.FAT);
+    snap->view.FAT = NULL;
+    snap->view.version = NULL;
+}
+
+// ----------- -------------------- -----------
+
+// ----------- a simple completement of hash index of names -----------
+
+# define DIR_INDEX_INIT_CAPACITY 16
+
+// FNV-1a hash of a 11-byte FAT name
+static DWORD hashFATName(const BYTE* name) {
+    DWORD hash = 2166136261u;
+    for (int i = 0; i < 11; ++i) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int dirIndexInit(dir_index* p) {
+    p->capacity = DIR_INDEX_INIT_CAPACITY;
+    p->storage = (dir_index_slot*)calloc(p->capacity, sizeof(dir_index_slot));
+    if (!p->storage) return 0;
+    p->size = 0;
+    p->deleted = 0;
+    p->free_slots = NULL;
+    p->free_slot_count = 0;
+    p->free_slot_max = 0;
+    p->has_end = 0;
+    p->end_clus_num = 0;
+    p->listing = NULL;
+    p->listing_count = 0;
+    p->listing_max = 0;
+    return 1;
+}
+
+// rebuild the table with `capacity` slots, which drops all deleted slots
+// return 1 when success, else return 0 (failed to alloc memory) and the table is not changed
+static int dirIndexRehash(dir_index* p, DWORD capacity) {
+    dir_index_slot* old_storage = p->storage;
+    DWORD old_capacity = p->capacity;
+    dir_index_slot* storage = (dir_index_slot*)calloc(capacity, sizeof(dir_index_slot));
+    if (!storage) return 0;
+    p->storage = storage;
+    p->capacity = capacity;
+    p->deleted = 0;
+    for (DWORD i = 0; i < old_capacity; ++i) {
+        if (old_storage[i].state != DIR_INDEX_USED) continue;
+        DWORD pos = hashFATName(old_storage[i].name) & (capacity - 1);
+        while (p->storage[pos].state != DIR_INDEX_EMPTY) pos = (pos + 1) & (capacity - 1);
+        p->storage[pos] = old_storage[i];
+    }
+    free(old_storage);
+    return 1;
+}
+
+// return 1 when inserted, return 0 if the name exists already (the old location is kept)
+// return -1 if failed to alloc memory, and the name is not inserted
+int dirIndexInsert(dir_index* p, const BYTE* name, ent_loc loc) {
+    // keep at least a quarter of slots empty, so that probing always ends
+    if ((p->size + p->deleted + 1) * 4 > p->capacity * 3 &&
+        !dirIndexRehash(p, (p->size + 1) * 2 > p->capacity ? p->capacity * 2 : p->capacity)) {
+        return -1;
+    }
+    DWORD mask = p->capacity - 1;
+    DWORD pos = hashFATName(name) & mask;
+    dir_index_slot* reusable = NULL; // the first deleted slot on the probing path
+    while (p->storage[pos].state != DIR_INDEX_EMPTY) {
+        dir_index_slot* slot = &p->storage[pos];
+        if (slot->state == DIR_INDEX_USED) {
+            if (!memcmp(slot->name, name, 11)) return 0;
+        } else if (!reusable) {
+            reusable = slot;
+        }
+        pos = (pos + 1) & mask;
+    }
+    dir_index_slot* slot = &p->storage[pos];
+    if (reusable) {
+        slot = reusable;
+        --p->deleted;
+    }
+    memcpy(slot->name, name, 11);
+    slot->state = DIR_INDEX_USED;
+    slot->loc = loc;
+    ++p->size;
+    return 1;
+}
+
+// return the used slot holding `name`, or NULL when not found
+static dir_index_slot* dirIndexFindSlot(const dir_index* p, const BYTE* name) {
+    DWORD mask = p->capacity - 1;
+    DWORD pos = hashFATName(name) & mask;
+    while (p->storage[pos].state != DIR_INDEX_EMPTY) {
+        dir_index_slot* slot = &p->storage[pos];
+        if (slot->state == DIR_INDEX_USED && !memcmp(slot->name, name, 11)) return slot;
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+// return NULL when not found
+const ent_loc* dirIndexFind(const dir_index* p, const BYTE* name) {
+    dir_index_slot* slot = dirIndexFindSlot(p, name);
+    return slot ? &slot->loc : NULL;
+}
+
+void dirIndexErase(dir_index* p, const BYTE* name) {
+    dir_index_slot* slot = dirIndexFindSlot(p, name);
+    if (!slot) return;
+    slot->state = DIR_INDEX_DELETED;
+    --p->size;
+    ++p->deleted;
+}
+
+int dirIndexPushFreeSlot(dir_index* p, ent_loc loc) {
+    if (p->free_slot_count == p->free_slot_max) {
+        DWORD max = p->free_slot_max ? p->free_slot_max * 2 : DIR_INDEX_INIT_CAPACITY;
+        ent_loc* free_slots = (ent_loc*)realloc(p->free_slots, sizeof(ent_loc) * max);
+        if (!free_slots) return 0;
+        p->free_slots = free_slots;
+        p->free_slot_max = max;
+    }
+    // sift up
+    DWORD i = p->free_slot_count++;
+    while (i > 0 && p->free_slots[(i - 1) / 2].ent_num > loc.ent_num) {
+        p->free_slots[i] = p->free_slots[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    p->free_slots[i] = loc;
+    return 1;
+}
+
+// return the free slot with the least `ent_num`, assume there is at least one
+ent_loc dirIndexPopFreeSlot(dir_index* p) {
+    ent_loc result = p->free_slots[0];
+    ent_loc last = p->free_slots[--p->free_slot_count];
+    // sift down
+    DWORD i = 0;
+    while (2 * i + 1 < p->free_slot_count) {
+        DWORD child = 2 * i + 1;
+        if (child + 1 < p->free_slot_count
+            && p->free_slots[child + 1].ent_num < p->free_slots[child].ent_num) ++child;
+        if (p->free_slots[child].ent_num >= last.ent_num) break;
+        p->free_slots[i] = p->free_slots[child];
+        i = child;
+    }
+    p->free_slots[i] = last;
+    return result;
+}
+
+void dirIndexDestroy(dir_index* p) {
+    free(p->storage);
+    free(p->free_slots);
+    free(p->listing);
+    free(p);
+}
+
+// ----------- ------------------------------------------ -----------
+
+// scan the directory to fill the index, return 1 when success, else return 0 (failed to alloc memory)
+static int buildDirIndex(const volume* vol, WORD dir_clus_num, dir_index* index) {
+    dir_iter it;
+    const file_entry* ents;
+    int count;
+    ent_loc loc;
+    WORD clus_num = dir_clus_num;
+    dirIterInit(vol, &it, dir_clus_num);
+    while ((ents = dirIterNext(vol, &it, &count, &loc, &clus_num))) {
+        ent_scan_mask mask;
+        scanEntries(ents, count, NULL, &mask);
+        // deleted ones are found in order, which keeps the heap property
+        for (DWORD bits = mask.live | mask.deleted; bits; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+            ent_loc now_loc = loc;
+            now_loc.slot += i;
+            now_loc.ent_num += i;
+            // the first one wins for duplicated names
+            if (mask.deleted & (1u << i)) {
+                if (!dirIndexPushFreeSlot(index, now_loc)) return 0;
+            } else if (dirIndexInsert(index, ents[i].DIR_Name, now_loc) < 0) {
+                return 0;
             }
         }
-    } else {
-        // now in normal subdirectory (non-root)
-        int root_bytes = header->BPB_RootEntCnt * sizeof(file_entry);
-        // assume bytes of root directory is a multiple of bytes per sector
-        int root_sectors = root_bytes / header->BPB_BytesPerSec;
-        int data_head_sec = 1 + FAT_sectors + root_sectors;
-
-        int now_clus_num = dir_clus_num;
-        int logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-        loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-        int i = 0;
-        for (;;) {
-            const file_entry* ent = &((const file_entry*)now_clus)[i];
-
-            if (*(const BYTE*)ent == 0x00) break; //empty
-            else if (*(const BYTE*)ent != FILE_DEL_BYTE) {
-                formatNameToNormal(ent->DIR_Name, buffer);
-                if (!(ent->DIR_Attr & FILE_ATTR_VOLLAB) && strcmp(buffer, ".") && strcmp(buffer, "..")) {
-                    // skip volumn label, self and last level directory
-                    ent_tree* sub_tree = NULL;
-                    if (ent->DIR_Attr & FILE_ATTR_DIR) {
-                        sub_tree = getEntTree(disk, ent->DIR_FstClus);
-                    }
-                    entTreeAppend(tree, ent, sub_tree);
+        if (mask.end) { // empty, no more entries
+            int i = __builtin_ctz(mask.end);
+            index->end = loc;
+            index->end.slot += i;
+            index->end.ent_num += i;
+            index->has_end = 1;
+            index->end_clus_num = clus_num;
+            return 1;
+        }
+    }
+    index->end.ent_num = it.ent_num;
+    index->end_clus_num = clus_num; // the last cluster
+    return 1;
+}
+
+// move `end` of the directory to the next entry
+static void advanceDirIndexEnd(const volume* vol, WORD dir_clus_num, dir_index* index) {
+    int entries_per_sec = vol->bytes_per_sec / sizeof(file_entry);
+    ent_loc* end = &index->end;
+    ++end->ent_num;
+    if (dir_clus_num == 0) {
+        if (end->ent_num >= vol->max_root_entries) {
+            index->has_end = 0;
+            return;
+        }
+    } else if (end->ent_num % vol->entries_per_clus == 0) {
+        // the next entry is in the next cluster (if any)
+        WORD next_clus_num = getNextClusNumFromFAT(vol, index->end_clus_num);
+        if (!clusNumIsData(vol, next_clus_num)) {
+            index->has_end = 0;
+            return;
+        }
+        index->end_clus_num = next_clus_num;
+        end->logic_sec_num = clusToLogicSec(vol, next_clus_num);
+        end->slot = 0;
+        return;
+    }
+    if (++end->slot >= entries_per_sec) {
+        end->slot = 0;
+        ++end->logic_sec_num;
+    }
+}
+
+// return index of the directory, which is built by scanning the directory on first access
+// return NULL if `dir_clus_num` is not a legal directory cluster, or memory can not be allocated
+dir_index* getDirIndex(const volume* vol, WORD dir_clus_num) {
+    // the view of a snapshot has no index, as it is read through `dirIterNext`
+    if (vol->version) return NULL;
+    if (dir_clus_num != 0 && !clusNumIsData(vol, dir_clus_num)) return NULL;
+    dir_index* index = __atomic_load_n(&vol->dir_indexes[dir_clus_num], __ATOMIC_ACQUIRE);
+    if (index) return index;
+    // readers holding the directory lock shared may build it at the same time, so only one of them does
+    pthread_mutex_lock(&volumeOf(vol)->index_lock);
+    index = vol->dir_indexes[dir_clus_num];
+    if (!index) {
+        index = (dir_index*)malloc(sizeof(dir_index));
+        if (index && !dirIndexInit(index)) {
+            free(index);
+            index = NULL;
+        }
+        if (index && !buildDirIndex(vol, dir_clus_num, index)) {
+            dirIndexDestroy(index);
+            index = NULL;
+        }
+        if (index) {
+            __atomic_store_n(&vol->dir_indexes[dir_clus_num], index, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&volumeOf(vol)->index_lock);
+    return index;
+}
+
+// drop index of the directory (if built), called when the directory is removed
+void dropDirIndex(const volume* vol, WORD dir_clus_num) {
+    if (dir_clus_num >= vol->clus_count || vol->version) return;
+    dir_index* index = __atomic_exchange_n(&vol->dir_indexes[dir_clus_num], NULL, __ATOMIC_ACQ_REL);
+    if (index) dirIndexDestroy(index);
+}
+
+// an entry with its location, used to sort the listing
+typedef struct listed_ent {
+    file_entry ent;
+    ent_loc loc;
+} listed_ent;
+
+static int listedEntCmp(const void* x, const void* y) {
+    return fileEntCmp(&((const listed_ent*)x)->ent, &((const listed_ent*)y)->ent);
+}
+
+// scan the directory to fill the listing of the index
+// the listing is left unbuilt if failed to alloc memory
+static void buildDirListing(const volume* vol, WORD dir_clus_num, dir_index* index) {
+    DWORD size = 0, max_size = 16;
+    listed_ent* ents_to_sort = (listed_ent*)malloc(sizeof(listed_ent) * max_size);
+    if (!ents_to_sort) return;
+    dir_iter it;
+    const file_entry* ents;
+    int count;
+    ent_loc loc;
+    dirIterInit(vol, &it, dir_clus_num);
+    while ((ents = dirIterNext(vol, &it, &count, &loc, NULL))) {
+        ent_scan_mask mask;
+        scanEntries(ents, count, NULL, &mask);
+        for (DWORD live = mask.live; live; live &= live - 1) {
+            int i = __builtin_ctz(live);
+            if (size == max_size) {
+                listed_ent* temp = (listed_ent*)realloc(ents_to_sort, sizeof(listed_ent) * max_size * 2);
+                if (!temp) {
+                    free(ents_to_sort);
+                    return;
                 }
+                ents_to_sort = temp;
+                max_size *= 2;
             }
+            ents_to_sort[size].ent = ents[i];
+            ents_to_sort[size].loc = loc;
+            ents_to_sort[size].loc.slot += i;
+            ents_to_sort[size].loc.ent_num += i;
+            ++size;
+        }
+        if (mask.end) break; // empty, no more entries
+    }
+    qsort(ents_to_sort, size, sizeof(listed_ent), listedEntCmp);
+    ent_loc* listing = (ent_loc*)malloc(sizeof(ent_loc) * max_size);
+    if (!listing) {
+        free(ents_to_sort);
+        return;
+    }
+    for (DWORD i = 0; i < size; ++i) listing[i] = ents_to_sort[i].loc;
+    free(ents_to_sort);
+    index->listing_max = max_size;
+    index->listing_count = size;
+    // published last, as others may read it without the lock
+    __atomic_store_n(&index->listing, listing, __ATOMIC_RELEASE);
+}
 
-            ++i;
-            if (i >= entries_per_clus) {
-                now_clus_num = getNextClusNumFromFAT(disk, now_clus_num);
-                if (clusNumIsEOF(now_clus_num)) break;
-                logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-                loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
+// insert the entry just written at `loc` into the listing (if built), keeping it sorted
+static void listEntInDir(const volume* vol, dir_index* index, ent_loc loc) {
+    if (!index->listing) return;
+    const file_entry* ent = entAtLoc(vol, loc);
+    // the new one goes after all entries not greater than it
+    DWORD low = 0, high = index->listing_count;
+    while (low < high) {
+        DWORD mid = (low + high) / 2;
+        if (fileEntCmp(entAtLoc(vol, index->listing[mid]), ent) <= 0) low = mid + 1;
+        else high = mid;
+    }
+    if (index->listing_count == index->listing_max) {
+        ent_loc* listing = (ent_loc*)realloc(index->listing, sizeof(ent_loc) * index->listing_max * 2);
+        if (!listing) {
+            // the listing is dropped, and built again on next access
+            free(index->listing);
+            index->listing = NULL;
+            index->listing_count = 0;
+            return;
+        }
+        index->listing = listing;
+        index->listing_max *= 2;
+    }
+    memmove(index->listing + low + 1, index->listing + low, sizeof(ent_loc) * (index->listing_count - low));
+    index->listing[low] = loc;
+    ++index->listing_count;
+}
+
+// remove an entry from the listing (if built)
+static void unlistEntInDir(dir_index* index, ent_loc loc) {
+    for (DWORD i = 0; i < index->listing_count; ++i) {
+        if (index->listing[i].ent_num != loc.ent_num) continue;
+        --index->listing_count;
+        memmove(index->listing + i, index->listing + i + 1, sizeof(ent_loc) * (index->listing_count - i));
+        return;
+    }
+}
+
+// remove the entry at `loc` from index of the directory (if built), and its slot becomes free
+void unindexEntInDir(volume* vol, WORD dir_clus_num, const BYTE* name, ent_loc loc) {
+    if (dir_clus_num >= vol->clus_count || !vol->dir_indexes[dir_clus_num]) return;
+    dir_index* index = vol->dir_indexes[dir_clus_num];
+    const ent_loc* found = dirIndexFind(index, name);
+    // a later entry with a duplicated name is not in the hash table, but it is still listed
+    if (found && found->ent_num == loc.ent_num) dirIndexErase(index, name);
+    unlistEntInDir(index, loc);
+    // the index without the slot could not be trusted, so it is dropped and built again on next access
+    if (!dirIndexPushFreeSlot(index, loc)) dropDirIndex(vol, dir_clus_num);
+}
+
+// return locations of live entries of the directory in the order of `fileEntCmp`, and the number in `count`
+// the list is sorted once and then kept up to date, return NULL if not a legal directory or failed to alloc memory
+const ent_loc* getDirListing(const volume* vol, WORD dir_clus_num, DWORD* count) {
+    dir_index* index = getDirIndex(vol, dir_clus_num);
+    if (!index) return NULL;
+    const ent_loc* listing = __atomic_load_n(&index->listing, __ATOMIC_ACQUIRE);
+    if (!listing) {
+        pthread_mutex_lock(&volumeOf(vol)->index_lock);
+        if (!index->listing) buildDirListing(vol, dir_clus_num, index);
+        listing = index->listing;
+        pthread_mutex_unlock(&volumeOf(vol)->index_lock);
+    }
+    *count = index->listing_count;
+    return listing;
+}
+
+// mark the directory starting at the cluster as walked, return 0 if it has been walked already
+// a directory reached again in a broken image is left out of the tree, so that the walk ends
+static int claimWalkedDir(const volume* vol, BYTE* visited, WORD clus_num) {
+    if (clus_num >= vol->clus_count) return 1;
+    if (visited[clus_num / 8] & (1 << (clus_num % 8))) return 0;
+    visited[clus_num / 8] |= (BYTE)(1 << (clus_num % 8));
+    return 1;
+}
+
+// append children of the `k`th node, which is a directory, to the end of the tree
+// return 1 when success, else return 0 (failed to alloc memory)
+static int appendDirChildren(const volume* vol, ent_tree* tree, DWORD k, BYTE* visited) {
+    DWORD first_child = tree->size;
+    dir_iter it;
+    const file_entry* ents;
+    int count;
+    dirIterInit(vol, &it, tree->storage[k].ent.DIR_FstClus);
+    while ((ents = dirIterNext(vol, &it, &count, NULL, NULL))) {
+        ent_scan_mask mask;
+        scanEntries(ents, count, NULL, &mask);
+        for (DWORD live = mask.live & ~mask.vollab; live; live &= live - 1) {
+            const file_entry* ent = &ents[__builtin_ctz(live)];
+            // skip volumn label, self and last level directory
+            if (entIsDotOrDotDot(ent)) continue;
+            if ((ent->DIR_Attr & FILE_ATTR_DIR) && !claimWalkedDir(vol, visited, ent->DIR_FstClus)) continue;
+            if (!entTreeAppend(tree, ent)) return 0;
+        }
+        if (mask.end) break; // empty, no more entries
+    }
+    tree->storage[k].first_child = first_child;
+    tree->storage[k].child_count = tree->size - first_child;
+    return 1;
+}
+
+// append everything in directories from the `k`th node on by `walkDirTrees`, in the same order as
+// `appendDirChildren` would do one by one. return 1 when success, else return 0 (failed to alloc memory)
+static int appendWalkedDirs(const volume* vol, ent_tree* tree, DWORD k, BYTE* visited) {
+    file_vector tops;
+    fileVectorInit(&tops);
+    int success = tops.storage != NULL;
+    for (DWORD i = k; success && i < tree->size; ++i) {
+        if (tree->storage[i].ent.DIR_Attr & FILE_ATTR_DIR) success = fileVectorAppend(&tops, &tree->storage[i].ent);
+    }
+    dir_walk walk;
+    success = success && walkDirTrees(vol, tops.storage, tops.size, &walk);
+    fileVectorDestroy(&tops);
+    if (!success) return 0;
+    const walk_dir** queue = (const walk_dir**)malloc(sizeof(walk_dir*) * walk.dir_count);
+    if (!queue || !entTreeReserve(tree, tree->size + walk.ent_count)) {
+        free(queue);
+        dirWalkDestroy(&walk);
+        return 0;
+    }
+    DWORD head = 0, tail = 0;
+    for (DWORD i = 0; i < walk.top_count; ++i) queue[tail++] = &walk.tops[i];
+    // directory nodes from the `k`th one on come in the order of `queue`
+    for (; k < tree->size; ++k) {
+        if (!(tree->storage[k].ent.DIR_Attr & FILE_ATTR_DIR)) continue;
+        const walk_dir* dir = queue[head++];
+        tree->storage[k].first_child = tree->size;
+        // the room is reserved, so appending never fails
+        for (DWORD i = 0, j = 0; i < dir->child_count; ++i) {
+            const file_entry* ent = &dir->children[i];
+            if (ent->DIR_Attr & FILE_ATTR_DIR) {
+                const walk_dir* sub = dir->subdirs[j++];
+                if (!claimWalkedDir(vol, visited, ent->DIR_FstClus)) continue;
+                queue[tail++] = sub;
             }
+            entTreeAppend(tree, ent);
         }
+        tree->storage[k].child_count = tree->size - tree->storage[k].first_child;
     }
-    free(now_clus);
-    if (tree->size == 0) {
-        entTreeDestroy(tree);
-        tree = NULL;
+    free(queue);
+    dirWalkDestroy(&walk);
+    return 1;
+}
+
+// build the tree of everything in the directory in one breadth-first walk
+// once many directories are waiting to be walked, they are walked by `walkDirTrees` if there are CPUs to do it
+int getEntTree(const volume* vol, WORD dir_clus_num, ent_tree* tree) {
+    entTreeInit(tree);
+    // one bit for each cluster, which is set once the directory starting at it is in the tree
+    BYTE* visited = (BYTE*)calloc(vol->clus_count / 8 + 1, 1);
+    // the directory itself is the first node, which has no entry for root
+    file_entry self;
+    memset(&self, 0, sizeof(file_entry));
+    self.DIR_Attr = FILE_ATTR_DIR;
+    self.DIR_FstClus = dir_clus_num;
+    int success = visited && entTreeAppend(tree, &self);
+    if (success) claimWalkedDir(vol, visited, dir_clus_num);
+    int parallel = walkWorkerCount() > 1;
+    DWORD waiting = 1; // directories appended but not walked
+    // children are appended after the node being walked, so the tree itself is the queue
+    for (DWORD k = 0; success && k < tree->size; ++k) {
+        if (!(tree->storage[k].ent.DIR_Attr & FILE_ATTR_DIR)) continue;
+        if (parallel && waiting >= WALK_PARALLEL_MIN_DIRS && appendWalkedDirs(vol, tree, k, visited)) break;
+        success = appendDirChildren(vol, tree, k, visited);
+        --waiting;
+        for (DWORD i = tree->storage[k].first_child; i < tree->size; ++i) {
+            if (tree->storage[i].ent.DIR_Attr & FILE_ATTR_DIR) ++waiting;
+        }
+    }
+    free(visited);
+    if (!success) entTreeDestroy(tree);
+    return success;
+}
+
+// copy live entries of the directory except volumn label, "." and ".." in the order of `fileEntCmp`
+// the listing kept in index is used for the volume, and the view of a snapshot, which has no index, is
+// read through `dirIterNext` and sorted here. return 1 when success, else return 0 (not a legal directory
+// or failed to alloc memory)
+int getDirChildren(const volume* vol, WORD dir_clus_num, file_vector* children) {
+    fileVectorInit(children);
+    if (!children->storage) return 0;
+    if (!vol->version) {
+        DWORD count;
+        const ent_loc* listing = getDirListing(vol, dir_clus_num, &count);
+        if (!listing) return 0;
+        for (DWORD i = 0; i < count; ++i) {
+            const file_entry* ent = entAtLoc(vol, listing[i]);
+            // skip volumn label, self and last level directory
+            if ((ent->DIR_Attr & FILE_ATTR_VOLLAB) || entIsDotOrDotDot(ent)) continue;
+            if (!fileVectorAppend(children, ent)) return 0;
+        }
+        return 1;
+    }
+    dir_iter it;
+    const file_entry* ents;
+    int count;
+    dirIterInit(vol, &it, dir_clus_num);
+    while ((ents = dirIterNext(vol, &it, &count, NULL, NULL))) {
+        ent_scan_mask mask;
+        scanEntries(ents, count, NULL, &mask);
+        for (DWORD live = mask.live & ~mask.vollab; live; live &= live - 1) {
+            const file_entry* ent = &ents[__builtin_ctz(live)];
+            if (entIsDotOrDotDot(ent)) continue;
+            if (!fileVectorAppend(children, ent)) return 0;
+        }
+        if (mask.end) break; // empty, no more entries
     }
-    return tree;
+    qsort(children->storage, children->size, sizeof(file_entry), fileEntCmp);
+    return 1;
 }
 
-void printEntTree(const ent_tree* p, const char* indent, int indent_len) {
-    qsort(p->storage, p->size, sizeof(ent_tree_node), entTreeNodeCmp);
+// print the tree below the directory, skipping directories in `visited`, which are those already printed
+static void printDirTreeVisit(FILE* out, const volume* vol, WORD dir_clus_num, const char* indent, int indent_len,
+                              BYTE* visited) {
+    file_vector children;
+    lockDir(vol, dir_clus_num, 0);
+    int success = getDirChildren(vol, dir_clus_num, &children);
+    unlockDir(vol, dir_clus_num);
+
     char buffer[13];
     // append 4 char to next level, and a byte '\0'
-    char* next_indent = (char*)malloc(indent_len + 5);
+    char* next_indent = success ? (char*)malloc(indent_len + 5) : NULL;
+    if (!next_indent) {
+        fileVectorDestroy(&children);
+        return;
+    }
     sprintf(next_indent, "%s |  ", indent);
-    for (size_t i = 0; i < p->size; ++i) {
+    for (int i = 0; i < children.size; ++i) {
+        const file_entry* child = &children.storage[i];
         // the last one is a little special
-        formatNameToNormal(p->storage[i].ent.DIR_Name, buffer);
-        if (i == p->size - 1) {
+        formatNameToNormal(child->DIR_Name, buffer);
+        if (i == children.size - 1) {
             sprintf(next_indent, "%s    ", indent);
-            printf("%s `-- %s\n", indent, buffer);
+            fprintf(out, "%s `-- %s\n", indent, buffer);
         }
-        else printf("%s |-- %s\n", indent, buffer);
-        
-        if (p->storage[i].sub_tree != NULL) {
-            printEntTree(p->storage[i].sub_tree, next_indent, indent_len + 4);
+        else fprintf(out, "%s |-- %s\n", indent, buffer);
+
+        if (child->DIR_Attr & FILE_ATTR_DIR) {
+            WORD clus_num = child->DIR_FstClus;
+            // in a broken image a directory may be reached again from inside itself
+            if (clus_num >= vol->clus_count || (visited[clus_num / 8] & (1 << (clus_num % 8)))) continue;
+            visited[clus_num / 8] |= (BYTE)(1 << (clus_num % 8));
+            printDirTreeVisit(out, vol, clus_num, next_indent, indent_len + 4, visited);
         }
     }
     free(next_indent);
+    fileVectorDestroy(&children);
 }
 
-void destroyEntClusInfo(ent_clus* p) {
-    free(p->clus_buf);
-    free(p);
+// print everything in the directory as a tree, in the same order as the listing of each directory
+// each directory is locked only while its children are copied out, so no two directory locks are held at once
+void printDirTreeByClus(FILE* out, const volume* vol, WORD dir_clus_num, const char* indent, int indent_len) {
+    if (dir_clus_num >= vol->clus_count) return;
+    // one bit for each cluster, which is set once the directory starting at it is printed
+    BYTE* visited = (BYTE*)calloc(vol->clus_count / 8 + 1, 1);
+    if (!visited) return;
+    visited[dir_clus_num / 8] |= (BYTE)(1 << (dir_clus_num % 8));
+    printDirTreeVisit(out, vol, dir_clus_num, indent, indent_len, visited);
+    free(visited);
 }
 
-// get file entry with cluster buffer and infomation, return NULL when not found
-// the pointer returned (except NULL) should be destroyed by `destroyEntClusInfo`
-ent_clus* getFileEntWithClusInfoByName(const floppy* disk, WORD dir_clus_num, const char* name) {
-    char file_name[12];
-    char ent_name[12];
-    memset(ent_name, 0, 12);
-    formatNameToFATType(name, (BYTE*)file_name);
-    file_name[11] = '\0';
-
-    const fat12_header* header = (const fat12_header*)disk->storage;
-
-    int sec_per_clus = header->BPB_SecPerClus;
-    int bytes_per_clus = sec_per_clus * header->BPB_BytesPerSec;
-    // assume bytes_per_clus is a multiple of sizeof(file_entry)
-    int entries_per_clus = bytes_per_clus / sizeof(file_entry);
-
-    int FAT_sectors = header->BPB_NumFATs * header->BPB_FATSz16;
+// overwrite the entry at the location in the image
+void writeEntAtLoc(volume* vol, ent_loc loc, const file_entry* ent) {
+    size_t offset = logicSecToOffset(vol, loc.logic_sec_num) + loc.slot * sizeof(file_entry);
+    markDirty(vol->disk, offset, sizeof(file_entry));
+    memcpy(vol->disk->storage + offset, ent, sizeof(file_entry));
+}
 
-    BYTE* now_clus = (BYTE*)malloc(bytes_per_clus);
-    ent_clus* result = (ent_clus*)malloc(sizeof(ent_clus));
-    result->clus_buf = now_clus;
-    result->sec_per_clus = sec_per_clus;
-    if (dir_clus_num == 0) {
-        // now in root directory
-        int root_head_sec = 1 + FAT_sectors;
-        int max_root_entries = header->BPB_RootEntCnt;
-
-        loadSectors(disk, root_head_sec, sec_per_clus, now_clus);
-        int total = 0, i = 0;
-        while (total < max_root_entries) {
-            file_entry* ent = &((file_entry*)now_clus)[i];
-
-            if (*(const BYTE*)ent == 0x00) break; // empty
-            else if (*(const BYTE*)ent != FILE_DEL_BYTE) {
-                memcpy(ent_name, ent->DIR_Name, 11);
-                if (!strcmp(ent_name, file_name)) { // the entry is found
-                    int offset = (total/entries_per_clus) * sec_per_clus;
-                    result->logic_sec_num = root_head_sec + offset;
-                    result->ent = ent;
-                    return result;
-                }
-            }
+// mark the entry as deleted, both in the image and in index of its directory
+void deleteEntByRef(volume* vol, const ent_ref* ref) {
+    unindexEntInDir(vol, ref->dir_clus_num, ref->ent.DIR_Name, ref->loc);
+    file_entry deleted = ref->ent;
+    deleted.DIR_Name[0] = FILE_DEL_BYTE;
+    writeEntAtLoc(vol, ref->loc, &deleted);
+}
 
-            ++total;
-            ++i;
-            if (i >= entries_per_clus) {
-                int offset = (total/entries_per_clus) * sec_per_clus;
-                loadSectors(disk, root_head_sec + offset, sec_per_clus, now_clus);
-            }
-        }
-    } else {
-        // now in normal subdirectory (non-root)
-        int FAT_sectors = header->BPB_NumFATs * header->BPB_FATSz16;
-        int root_bytes = header->BPB_RootEntCnt * sizeof(file_entry);
-        // assume bytes of root directory is a multiple of bytes per sector
-        int root_sectors = root_bytes / header->BPB_BytesPerSec;
-        int data_head_sec = 1 + FAT_sectors + root_sectors;
-
-        int now_clus_num = dir_clus_num;
-        int logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-        loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-        int i = 0;
-        for (;;) {
-            file_entry* ent = &((file_entry*)now_clus)[i];
-
-            if (*(const BYTE*)ent == 0x00) break; //empty
-            else if (*(const BYTE*)ent != FILE_DEL_BYTE) {
-                memcpy(ent_name, ent->DIR_Name, 11);
-                if (!strcmp(ent_name, file_name)) { // the entry is found
-                    result->logic_sec_num = logic_sec_num;
-                    result->ent = ent;
-                    return result;
-                }
-            }
+// find the entry by name in specified directory, return 1 when found, else return 0
+int getFileEntRefByName(const volume* vol, WORD dir_clus_num, const char* name, ent_ref* ref) {
+    BYTE file_name[11];
+    formatNameToFATType(name, file_name);
+    return getFileEntRefByFATName(vol, dir_clus_num, file_name, ref);
+}
 
-            ++i;
-            if (i >= entries_per_clus) {
-                now_clus_num = getNextClusNumFromFAT(disk, now_clus_num);
-                if (clusNumIsEOF(now_clus_num)) break;
-                logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-                loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-            }
+// find the first live entry with the name by walking the directory, which is how the view of a snapshot is searched
+static int findEntInView(const volume* vol, WORD dir_clus_num, const BYTE* name, ent_ref* ref) {
+    if (dir_clus_num != 0 && !clusNumIsData(vol, dir_clus_num)) return 0;
+    dir_iter it;
+    const file_entry* ents;
+    int count;
+    ent_loc loc;
+    dirIterInit(vol, &it, dir_clus_num);
+    while ((ents = dirIterNext(vol, &it, &count, &loc, NULL))) {
+        ent_scan_mask mask;
+        scanEntries(ents, count, name, &mask);
+        if (mask.match) {
+            int i = __builtin_ctz(mask.match);
+            ref->ent = ents[i];
+            ref->dir_clus_num = dir_clus_num;
+            ref->loc = loc;
+            ref->loc.slot += i;
+            ref->loc.ent_num += i;
+            return 1;
         }
+        if (mask.end) break; // empty, no more entries
     }
-    free(now_clus);
-    free(result);
-    return NULL;
+    return 0;
 }
 
-// get file entry by name in specified directory, return pointer to a copy of the file entry
-// return NULL when not found
-// the pointer (except NULL) returned should be detroyed by `free` or a memory leak problem occurred
-file_entry* getFileEntByName(const floppy* disk, WORD dir_clus_num, const char* name) {
-    ent_clus* info = getFileEntWithClusInfoByName(disk, dir_clus_num, name);
-    if (!info) return NULL; // not found
-    file_entry* result = (file_entry*)malloc(sizeof(file_entry));
-    memcpy(result, info->ent, sizeof(file_entry));
-    destroyEntClusInfo(info);
-    return result;
+// the same as `getFileEntRefByName`, but the name is in FAT format
+int getFileEntRefByFATName(const volume* vol, WORD dir_clus_num, const BYTE* name, ent_ref* ref) {
+    if (vol->version) return findEntInView(vol, dir_clus_num, name, ref);
+    dir_index* index = getDirIndex(vol, dir_clus_num);
+    if (!index) return 0;
+    const ent_loc* loc = dirIndexFind(index, name);
+    if (!loc) return 0; // not found
+    ref->ent = *entAtLoc(vol, *loc);
+    ref->dir_clus_num = dir_clus_num;
+    ref->loc = *loc;
+    return 1;
+}
+
+// get a copy of file entry by name in specified directory, return 1 when found, else return 0
+int getFileEntByName(const volume* vol, WORD dir_clus_num, const char* name, file_entry* ent) {
+    ent_ref ref;
+    if (!getFileEntRefByName(vol, dir_clus_num, name, &ref)) return 0; // not found
+    *ent = ref.ent;
+    return 1;
 }
 
-// get file entry with cluster buffer and infomation, return NULL when not found
-// the pointer returned (except NULL) should be destroyed by `destroyEntClusInfo`
-ent_clus* getFileEntWithClusInfoByPath(const floppy* disk, WORD dir_clus_num, const char* path) {
+// find the entry by the first `len` characters of path, return 1 when found, else return 0
+int getFileEntRefByPathLen(const volume* vol, WORD dir_clus_num, const char* path, int len, ent_ref* ref) {
     int start = 0, end = 0;
-    int len = strlen(path);
-    if (path[0] == '/') {
+    if (len > 0 && path[0] == '/') {
         // absolute path
         dir_clus_num = 0;
         ++start;
         ++end;
         if (start == len) { // path is only "/", root has no entry so we should build one
-            file_entry* ent = (file_entry*)malloc(sizeof(file_entry));
-            ent->DIR_Attr = FILE_ATTR_DIR;
-            ent->DIR_FstClus = 0;
-            ent_clus* result = (ent_clus*)malloc(sizeof(ent_clus));
-            result->clus_buf = (BYTE*)ent;
-            result->logic_sec_num = -1;
-            result->sec_per_clus = 0;
-            result->ent = ent;
-            return result;
+            memset(ref, 0, sizeof(ent_ref));
+            ref->ent.DIR_Attr = FILE_ATTR_DIR;
+            ref->ent.DIR_FstClus = 0;
+            return 1;
         }
     }
     char buffer[256];
     while (end < len) {
         if (path[start] == '/') {
             // probably "//" exists in path which is illegal
-            return NULL;
+            return 0;
         }
         if (path[end] == '/') {
             int this_len = end - start;
-            if (this_len > 255) return NULL; // prevent buffer out-of-bounds access
+            if (this_len > 255) return 0; // prevent buffer out-of-bounds access
             memcpy(buffer, path + start, this_len);
             buffer[this_len] = '\0';
-            ent_clus* info = getFileEntWithClusInfoByName(disk, dir_clus_num, buffer);
-            if (!info) return NULL; // not found
-            else if (!(info->ent->DIR_Attr & FILE_ATTR_DIR)) {
+            lockDir(vol, dir_clus_num, 0);
+            int found = getFileEntRefByName(vol, dir_clus_num, buffer, ref);
+            unlockDir(vol, dir_clus_num);
+            if (!found) return 0; // not found
+            else if (!(ref->ent.DIR_Attr & FILE_ATTR_DIR)) {
                 // a file path should not be ended with '/', so it's a illegal path
-                destroyEntClusInfo(info);
-                return NULL;
+                return 0;
             }
-            dir_clus_num = info->ent->DIR_FstClus;
+            dir_clus_num = ref->ent.DIR_FstClus;
             start = end + 1;
-            // decide either return the info or free it
-            if (start == len) return info;
-            else destroyEntClusInfo(info);
+            if (start == len) return 1;
         }
         ++end;
     }
     // if execute here, start must be less than len
     int this_len = len - start;
-    if (this_len > 255) return NULL; // prevent buffer out-of-bounds access
+    if (this_len > 255) return 0; // prevent buffer out-of-bounds access
     memcpy(buffer, path + start, this_len);
     buffer[this_len] = '\0';
-    ent_clus* info = getFileEntWithClusInfoByName(disk, dir_clus_num, buffer);
-    //if (!info) return NULL; // not found
-    return info;
+    lockDir(vol, dir_clus_num, 0);
+    int found = getFileEntRefByName(vol, dir_clus_num, buffer, ref);
+    unlockDir(vol, dir_clus_num);
+    return found;
+}
+
+// find the entry by path, return 1 when found, else return 0
+int getFileEntRefByPath(const volume* vol, WORD dir_clus_num, const char* path, ent_ref* ref) {
+    return getFileEntRefByPathLen(vol, dir_clus_num, path, strlen(path), ref);
 }
 
-// get file entry by path, return pointer to a copy of the file entry, return NULL when not found
-// the pointer (except NULL) returned should be detroyed by `free` or a memory leak problem occurred
-file_entry* getFileEntByPath(const floppy* disk, WORD dir_clus_num, const char* path) {
-    ent_clus* info = getFileEntWithClusInfoByPath(disk, dir_clus_num, path);
-    if (!info) return NULL; // not found
-    file_entry* ent = (file_entry*)malloc(sizeof(file_entry));
-    memcpy(ent, info->ent, sizeof(file_entry));
-    destroyEntClusInfo(info);
-    return ent;
+// get a copy of file entry by path, return 1 when found, else return 0
+int getFileEntByPath(const volume* vol, WORD dir_clus_num, const char* path, file_entry* ent) {
+    ent_ref ref;
+    if (!getFileEntRefByPath(vol, dir_clus_num, path, &ref)) return 0; // not found
+    *ent = ref.ent;
+    return 1;
 }
 
 // simplify a absolute direcotry path stirng
@@ -577,370 +1833,671 @@ void simplifyAbsolutePathString(char* path) {
 
 // read file content to buffer, return number of cluters loaded
 // return 0 is the file size doesn't match FAT record
-int readFileContentByEnt(const floppy* disk, const file_entry* ent, BYTE* buf) {
-    const fat12_header* header = (const fat12_header*)disk->storage;
+int readFileContentByEnt(const volume* vol, const file_entry* ent, BYTE* buf) {
+    const DWORD bytes_per_clus = vol->bytes_per_clus;
+    const size_t data_offset = logicSecToOffset(vol, vol->data_head_sec);
+    const DWORD total = bytesToClusCount(vol, ent->DIR_FileSize);
 
-    int FAT_sectors = header->BPB_NumFATs * header->BPB_FATSz16;
-    int root_bytes = header->BPB_RootEntCnt * sizeof(file_entry);
-    // assume bytes of root directory is a multiple of bytes per sector
-    int root_sectors = root_bytes / header->BPB_BytesPerSec;
-    int data_head_sec = 1 + FAT_sectors + root_sectors;
-
-    int sec_per_clus = header->BPB_SecPerClus;
-    int bytes_per_clus = sec_per_clus * header->BPB_BytesPerSec;
+    WORD cur_clus_num = ent->DIR_FstClus;
+    DWORD counter = 0;
+    while (counter < total && clusNumIsData(vol, cur_clus_num)) {
+        // copy a run of continuous clusters at once, straight from the image
+        WORD run_head = cur_clus_num;
+        DWORD run_len = 0;
+        do {
+            ++run_len;
+            cur_clus_num = getNextClusNumFromFAT(vol, cur_clus_num);
+        } while (counter + run_len < total && cur_clus_num == run_head + run_len);
+        counter += run_len;
+        DWORD size = run_len * bytes_per_clus;
+        if (counter == total) size -= total * bytes_per_clus - ent->DIR_FileSize; // the last one
+        size_t offset = data_offset + (size_t)(run_head - 2) * bytes_per_clus;
+        if (vol->version) readFloppyVersion(vol->disk, vol->version, offset, size, buf);
+        else memcpy(buf, vol->disk->storage + offset, size);
+        buf += size;
+    }
+    // test if file size matches FAT record, an empty file may hold one cluster or none
+    if (counter != total || (total > 0 && !clusNumIsEOF(cur_clus_num))) return 0;
+    return total ? total : 1;
+}
 
+// open the file of the entry at its head for read, return 1 when success
+// return 0 if the file size doesn't match FAT record, or failed to alloc memory
+int openFileByEnt(const volume* vol, const file_entry* ent, file_handle* fh) {
+    const DWORD total = bytesToClusCount(vol, ent->DIR_FileSize);
+    fh->extents = (file_extent*)malloc(sizeof(file_extent) * 2);
+    if (!fh->extents) return 0;
+    fh->extent_max = 2;
+    fh->extent_count = 0;
+    // validate the chain and build the extent map in one walk, so that reading never runs out of it
+    // an empty file may hold one cluster or none
+    const DWORD limit = total ? total : 1;
     WORD cur_clus_num = ent->DIR_FstClus;
-    BYTE* cur_clus = (BYTE*)malloc(bytes_per_clus);
-    int counter = 0;
-    while (1) {
-        int logic_sec_num = data_head_sec + (cur_clus_num - 2) * sec_per_clus;
-        loadSectors(disk, logic_sec_num, sec_per_clus, cur_clus);
-        ++counter;
-
-        cur_clus_num = getNextClusNumFromFAT(disk, cur_clus_num);
-        if (clusNumIsEOF(cur_clus_num)) {
-            int rest_size = ent->DIR_FileSize % bytes_per_clus;
-            if (rest_size == 0) rest_size = bytes_per_clus;
-            memcpy(buf + (counter-1) * bytes_per_clus, cur_clus, rest_size);
-            break;
+    DWORD counter = 0;
+    int extents_ok = 1;
+    for (; extents_ok && counter < limit && clusNumIsData(vol, cur_clus_num); ++counter) {
+        extents_ok = appendFileExtent(fh, cur_clus_num);
+        cur_clus_num = getNextClusNumFromFAT(vol, cur_clus_num);
+    }
+    if (!extents_ok || counter < total || (counter > 0 && !clusNumIsEOF(cur_clus_num))) {
+        free(fh->extents);
+        return 0;
+    }
+    fh->vol = (volume*)vol; // never written through, as `writable` is 0
+    fh->writable = 0;
+    fh->changed = 0;
+    fh->head_clus_num = counter ? ent->DIR_FstClus : 0;
+    fh->size = ent->DIR_FileSize;
+    fh->pos = 0;
+    fh->extent_index = 0;
+    return 1;
+}
+
+// make room for at least `count` extents in the map, return 1 when success, else return 0
+int reserveFileExtents(file_handle* fh, int count) {
+    if (count <= fh->extent_max) return 1;
+    int max = fh->extent_max;
+    while (max < count) max *= 2;
+    file_extent* extents = (file_extent*)realloc(fh->extents, sizeof(file_extent) * max);
+    if (!extents) return 0;
+    fh->extents = extents;
+    fh->extent_max = max;
+    return 1;
+}
+
+// add the cluster to the end of the extent map, merging it into the last extent if possible
+// return 1 when success, else return 0 (failed to alloc memory) and the map is not changed
+int appendFileExtent(file_handle* fh, WORD clus_num) {
+    if (fh->extent_count) {
+        file_extent* last = &fh->extents[fh->extent_count - 1];
+        if (last->start + last->len == clus_num) {
+            ++last->len;
+            return 1;
         }
-        memcpy(buf + (counter-1) * bytes_per_clus, cur_clus, bytes_per_clus);
     }
-    free(cur_clus);
-    // test if file size matches FAT record
-    if (counter != (ent->DIR_FileSize + bytes_per_clus-1)/bytes_per_clus) return 0;
-    return counter;
+    if (!reserveFileExtents(fh, fh->extent_count + 1)) return 0;
+    file_extent* ext = &fh->extents[fh->extent_count];
+    ext->file_clus = fileClusTotal(fh);
+    ext->start = clus_num;
+    ext->len = 1;
+    ++fh->extent_count;
+    return 1;
 }
 
-// alloc `count` number of data clusters in FAT record
-// if the `pre` parameter is not 0, FAT[pre] would be changed to the first allocated cluster
-// no matter `pre` is 0 or not, return the number of the first allocated cluster
-// if allocating failed, return 0
-WORD allocFATClus(floppy* disk, unsigned int count, WORD pre_clus) {
-    const fat12_header* const header = (const fat12_header* const)disk->storage;
-    int num_FATs = header->BPB_NumFATs;
-    int secs_per_FAT = header->BPB_FATSz16;
-    int bytes_per_FAT = secs_per_FAT * header->BPB_BytesPerSec;
+// index of the extent holding cluster `file_clus` of the file, or the last one if it is beyond the chain
+int findFileExtent(const file_handle* fh, DWORD file_clus) {
+    // the last extent whose head is not after `file_clus`
+    int lo = 0, hi = fh->extent_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (fh->extents[mid].file_clus <= file_clus) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// image offset of byte `pos` of the opened file and number of continuous bytes there (at most `len`)
+size_t fileSpanAtPos(file_handle* fh, size_t len, size_t* offset) {
+    const volume* vol = fh->vol;
+    const file_extent* ext = &fh->extents[fh->extent_index];
+    size_t ext_end = (size_t)(ext->file_clus + ext->len) * vol->bytes_per_clus;
+    if (fh->pos == ext_end) {
+        ext = &fh->extents[++fh->extent_index];
+        ext_end += (size_t)ext->len * vol->bytes_per_clus;
+    }
+    size_t in_ext = fh->pos - (size_t)ext->file_clus * vol->bytes_per_clus;
+    *offset = logicSecToOffset(vol, clusToLogicSec(vol, ext->start)) + in_ext;
+    return ext_end - fh->pos < len ? ext_end - fh->pos : len;
+}
+
+// build `vol->free_extents` from the decoded FAT
+int buildFreeExtents(volume* vol) {
+    // free runs are separated by used clusters, so there are at most half of clusters
+    vol->free_extents = (free_extent*)malloc(sizeof(free_extent) * (vol->clus_count / 2 + 1));
+    if (!vol->free_extents) return 0;
+    vol->free_extent_count = 0;
+    vol->free_clus_count = 0;
+    vol->next_fit = 2;
+    WORD i = 2;
+    while (i < vol->clus_count) {
+        if (vol->FAT[i] != NOT_USED_CLUSTER_NUM) {
+            ++i;
+            continue;
+        }
+        WORD start = i;
+        while (i < vol->clus_count && vol->FAT[i] == NOT_USED_CLUSTER_NUM) ++i;
+        free_extent* ext = &vol->free_extents[vol->free_extent_count++];
+        ext->start = start;
+        ext->len = i - start;
+        vol->free_clus_count += ext->len;
+    }
+    return 1;
+}
+
+// return index of the first free extent whose start is not less than `clus_num`
+int lowerBoundFreeExtent(const volume* vol, WORD clus_num) {
+    int low = 0, high = vol->free_extent_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (vol->free_extents[mid].start < clus_num) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
 
-    BYTE* FAT1 = (BYTE*)malloc(bytes_per_FAT); // assume FAT1 is not broken
-    // FAT1 is started at the second sector (1 if count from 0) just after MBR sector
-    loadSectors(disk, 1, secs_per_FAT, FAT1);
+// take at most `count` clusters from the head of the `index`th free extent
+// return number of clusters taken, and the taken run starts at `*start`
+WORD takeFromFreeExtent(volume* vol, int index, WORD count, WORD* start) {
+    free_extent* ext = &vol->free_extents[index];
+    if (count > ext->len) count = ext->len;
+    *start = ext->start;
+    ext->start += count;
+    ext->len -= count;
+    if (ext->len == 0) { // the extent is used up
+        memmove(ext, ext + 1, sizeof(free_extent) * (vol->free_extent_count - index - 1));
+        --vol->free_extent_count;
+    }
+    vol->free_clus_count -= count;
+    return count;
+}
+
+// put a run of clusters back to free extents, merging it with its neighbours
+void releaseFreeRun(volume* vol, WORD start, WORD len) {
+    int index = lowerBoundFreeExtent(vol, start);
+    free_extent* prev = index > 0 ? &vol->free_extents[index - 1] : NULL;
+    free_extent* next = index < vol->free_extent_count ? &vol->free_extents[index] : NULL;
+    int merge_prev = prev && prev->start + prev->len == start;
+    int merge_next = next && start + len == next->start;
+    if (merge_prev && merge_next) {
+        prev->len += len + next->len;
+        memmove(next, next + 1, sizeof(free_extent) * (vol->free_extent_count - index - 1));
+        --vol->free_extent_count;
+    } else if (merge_prev) {
+        prev->len += len;
+    } else if (merge_next) {
+        next->start = start;
+        next->len += len;
+    } else {
+        free_extent* ext = &vol->free_extents[index];
+        memmove(ext + 1, ext, sizeof(free_extent) * (vol->free_extent_count - index));
+        ext->start = start;
+        ext->len = len;
+        ++vol->free_extent_count;
+    }
+    vol->free_clus_count += len;
+}
+
+// alloc `count` number of data clusters in FAT record without cleaning them up
+// the last allocated cluster is returned in `tail_clus` if it is not NULL
+WORD allocFATChain(volume* vol, unsigned int count, WORD pre_clus, WORD* tail_clus) {
+    if (count == 0) count = 1; // an empty file still holds one cluster
+    pthread_mutex_lock(&vol->alloc_lock);
+    if (count > vol->free_clus_count) { // space of disk not enough
+        pthread_mutex_unlock(&vol->alloc_lock);
+        return 0;
+    }
 
-    WORD max_clusters = (header->BPB_FATSz16 * header->BPB_BytesPerSec) * 2 / 3; // divided by 1.5
     WORD head_clus = 0;
-    int head_clus_is_set = 0;
-    int allocated = 0; // number of allocated clusters
-    for (WORD i = 2; i < max_clusters; ++i) {
-        if (readFATAtPosition(FAT1, i) == NOT_USED_CLUSTER_NUM) {
-            if (pre_clus) {
-                writeFATAtPosition(FAT1, pre_clus, i);
+    WORD rest = count;
+    while (rest > 0) {
+        int index = -1;
+        // 1. grow the chain in place when the cluster right after it is free
+        if (pre_clus) {
+            int i = lowerBoundFreeExtent(vol, pre_clus + 1);
+            if (i < vol->free_extent_count && vol->free_extents[i].start == pre_clus + 1) {
+                index = i;
             }
-            if (!head_clus_is_set) { // set the head_clus to return
-                head_clus = i;
-                head_clus_is_set = 1;
+        }
+        // 2. next-fit for small allocations, so that they are packed near each other
+        if (index < 0 && rest <= SMALL_ALLOC_CLUS_COUNT) {
+            int first = lowerBoundFreeExtent(vol, vol->next_fit);
+            for (int k = 0; k < vol->free_extent_count; ++k) {
+                int i = (first + k) % vol->free_extent_count;
+                if (vol->free_extents[i].len >= rest) {
+                    index = i;
+                    break;
+                }
+            }
+        }
+        // 3. best-fit for one contiguous run, or the largest run when nothing fits
+        if (index < 0) {
+            int largest = 0;
+            for (int i = 0; i < vol->free_extent_count; ++i) {
+                WORD len = vol->free_extents[i].len;
+                if (len >= rest && (index < 0 || len < vol->free_extents[index].len)) {
+                    index = i;
+                }
+                if (len > vol->free_extents[largest].len) largest = i;
+            }
+            if (index < 0) index = largest;
+        }
+
+        WORD start;
+        WORD taken = takeFromFreeExtent(vol, index, rest, &start);
+        for (WORD i = start; i < start + taken; ++i) {
+            if (pre_clus) {
+                setFATEntry(vol, pre_clus, i);
             }
-            writeFATAtPosition(FAT1, i, EOF_CLUSTER_NUM);
             pre_clus = i;
-            ++allocated;
-            if (allocated >= count) break;
         }
+        setFATEntry(vol, pre_clus, EOF_CLUSTER_NUM);
+        if (!head_clus) head_clus = start; // set the head_clus to return
+        vol->next_fit = start + taken;
+        rest -= taken;
     }
-    if (allocated < count) { // space of disk not enough
-        head_clus = 0;
-    } else {
-        // write back, all FAT (usually FAT1 and FAT2) should be written
-        for (int i = 0; i < num_FATs; ++i) {
-            writeSectors(disk, 1 + secs_per_FAT * i, secs_per_FAT, FAT1);
-        }
-
-        // clean up the clusters
-        int FAT_sectors = num_FATs * secs_per_FAT;
-        int root_bytes = header->BPB_RootEntCnt * sizeof(file_entry);
-        // assume bytes of root directory is a multiple of bytes per sector
-        int root_sectors = root_bytes / header->BPB_BytesPerSec;
-        int data_head_sec = 1 + FAT_sectors + root_sectors;
-        int sec_per_clus = header->BPB_SecPerClus;
-        int bytes_per_clus = header->BPB_BytesPerSec * sec_per_clus;
-
-        BYTE* buffer = (BYTE*)malloc(bytes_per_clus);
-        memset(buffer, 0, bytes_per_clus); // set all clusters to all 0
-        WORD cur_clus_num = head_clus;
-        while (!clusNumIsEOF(cur_clus_num)) {
-            int logic_sec_num = data_head_sec + (cur_clus_num - 2) * sec_per_clus;
-            writeSectors(disk, logic_sec_num, sec_per_clus, buffer);
-            cur_clus_num = readFATAtPosition(FAT1, cur_clus_num);
-        }
-        free(buffer);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    if (tail_clus) *tail_clus = pre_clus;
+    return head_clus;
+}
+
+// fill bytes [from, bytes_per_clus) of the cluster with 0
+void zeroClusTail(volume* vol, WORD clus_num, DWORD from) {
+    if (from >= vol->bytes_per_clus) return;
+    size_t offset = logicSecToOffset(vol, clusToLogicSec(vol, clus_num)) + from;
+    markDirty(vol->disk, offset, vol->bytes_per_clus - from);
+    memset(vol->disk->storage + offset, 0, vol->bytes_per_clus - from);
+}
+
+// alloc `count` number of data clusters in FAT record
+// if the `pre` parameter is not 0, FAT[pre] would be changed to the first allocated cluster
+// no matter `pre` is 0 or not, return the number of the first allocated cluster
+// if allocating failed, return 0
+WORD allocFATClus(volume* vol, unsigned int count, WORD pre_clus) {
+    WORD head_clus = allocFATChain(vol, count, pre_clus, NULL);
+    if (!head_clus) return 0;
+    // clean up the clusters
+    for (WORD i = head_clus; !clusNumIsEOF(i); i = getNextClusNumFromFAT(vol, i)) {
+        zeroClusTail(vol, i, 0);
     }
-    free(FAT1);
     return head_clus;
 }
 
-void freeFATClus(floppy* disk, WORD head_clus_num) {
-    const fat12_header* const header = (const fat12_header* const)disk->storage;
-    int num_FATs = header->BPB_NumFATs;
-    int secs_per_FAT = header->BPB_FATSz16;
-    int bytes_per_FAT = secs_per_FAT * header->BPB_BytesPerSec;
+// alloc clusters to hold `bytes` bytes, which would all be written by the caller from head of the chain
+// so only the rest of the last cluster is filled with 0. Return the same as `allocFATClus`
+WORD allocFATClusForWrite(volume* vol, DWORD bytes, WORD pre_clus) {
+    WORD tail_clus;
+    WORD head_clus = allocFATChain(vol, bytesToClusCount(vol, bytes), pre_clus, &tail_clus);
+    if (!head_clus) return 0;
+    DWORD count = bytesToClusCount(vol, bytes);
+    zeroClusTail(vol, tail_clus, count ? bytes - (count - 1) * vol->bytes_per_clus : 0);
+    return head_clus;
+}
 
-    BYTE* FAT1 = (BYTE*)malloc(bytes_per_FAT); // assume FAT1 is not broken
-    // FAT1 is started at the second sector (1 if count from 0) just after MBR sector
-    loadSectors(disk, 1, secs_per_FAT, FAT1);
+static int freeExtentCmp(const void* x, const void* y) {
+    return (int)((const free_extent*)x)->start - (int)((const free_extent*)y)->start;
+}
 
+// put runs of clusters back to free extents at once, the runs are sorted by start
+// and merged with free extents in one pass
+void releaseFreeRuns(volume* vol, free_extent* runs, int count) {
+    if (count == 0) return;
+    // runs of a tree allocated in order are mostly sorted already
+    for (int k = 1; k < count; ++k) {
+        if (runs[k - 1].start > runs[k].start) {
+            qsort(runs, count, sizeof(free_extent), freeExtentCmp);
+            break;
+        }
+    }
+    free_extent* merged = (free_extent*)malloc(sizeof(free_extent) * (vol->clus_count / 2 + 1));
+    if (!merged) {
+        // free extents always have room for half of clusters, so the runs could be put back in place one by one
+        for (int k = 0; k < count; ++k) releaseFreeRun(vol, runs[k].start, runs[k].len);
+        return;
+    }
+    int merged_count = 0;
+    int i = 0, j = 0;
+    while (i < vol->free_extent_count || j < count) {
+        free_extent next;
+        if (j == count || (i < vol->free_extent_count && vol->free_extents[i].start < runs[j].start)) {
+            next = vol->free_extents[i++];
+        } else {
+            next = runs[j];
+            vol->free_clus_count += runs[j].len;
+            ++j;
+        }
+        free_extent* last = merged_count ? &merged[merged_count - 1] : NULL;
+        if (last && last->start + last->len == next.start) {
+            last->len += next.len;
+        } else {
+            merged[merged_count++] = next;
+        }
+    }
+    free(vol->free_extents);
+    vol->free_extents = merged;
+    vol->free_extent_count = merged_count;
+}
+
+// clear FAT entries of the chain, and append runs of consecutive clusters in it to `runs`
+// a run right after the last one in `runs` is merged into it, so chains allocated in order collapse
+void cutFATChain(volume* vol, WORD head_clus_num, free_extent* runs, int* run_count) {
     WORD now_clus_num = head_clus_num;
-    while (!clusNumIsEOF(now_clus_num)) {
-        WORD next_clus_num = readFATAtPosition(FAT1, now_clus_num);
-        writeFATAtPosition(FAT1, now_clus_num, NOT_USED_CLUSTER_NUM);
+    // stop at cluster numbers out of data area, in case of a broken chain
+    while (2 <= now_clus_num && now_clus_num < vol->clus_count) {
+        WORD next_clus_num = vol->FAT[now_clus_num];
+        if (next_clus_num == NOT_USED_CLUSTER_NUM) break;
+        setFATEntry(vol, now_clus_num, NOT_USED_CLUSTER_NUM);
+        free_extent* last = *run_count ? &runs[*run_count - 1] : NULL;
+        if (last && last->start + last->len == now_clus_num) {
+            ++last->len;
+        } else {
+            runs[*run_count].start = now_clus_num;
+            runs[*run_count].len = 1;
+            ++*run_count;
+        }
         now_clus_num = next_clus_num;
     }
-    // write back, all FAT (usually FAT1 and FAT2) should be written
-    for (int i = 0; i < num_FATs; ++i) {
-        writeSectors(disk, 1 + secs_per_FAT * i, secs_per_FAT, FAT1);
+}
+
+void freeFATClus(volume* vol, WORD head_clus_num) {
+    // the cluster may be head of a removed directory, whose index must not be reused
+    dropDirIndex(vol, head_clus_num);
+    pthread_mutex_lock(&vol->alloc_lock);
+    WORD now_clus_num = head_clus_num;
+    WORD run_start = 0, run_len = 0; // run of consecutive clusters in the chain
+    // stop at cluster numbers out of data area, in case of a broken chain
+    while (2 <= now_clus_num && now_clus_num < vol->clus_count) {
+        WORD next_clus_num = vol->FAT[now_clus_num];
+        if (next_clus_num == NOT_USED_CLUSTER_NUM) break;
+        setFATEntry(vol, now_clus_num, NOT_USED_CLUSTER_NUM);
+        if (run_len && run_start + run_len == now_clus_num) {
+            ++run_len;
+        } else {
+            if (run_len) releaseFreeRun(vol, run_start, run_len);
+            run_start = now_clus_num;
+            run_len = 1;
+        }
+        now_clus_num = next_clus_num;
     }
-    free(FAT1);
+    if (run_len) releaseFreeRun(vol, run_start, run_len);
+    pthread_mutex_unlock(&vol->alloc_lock);
 }
 
 // append the entry in specific directory. Return 1 when succeed, else return 0
 // whoever use this function has the duty to ensure the entry is legal
-int appendEntInDir(floppy* disk, WORD dir_clus_num, const file_entry* ent_to_append) {
-    const fat12_header* header = (const fat12_header*)disk->storage;
-
-    int sec_per_clus = header->BPB_SecPerClus;
-    int bytes_per_clus = sec_per_clus * header->BPB_BytesPerSec;
-    // assume bytes_per_clus is a multiple of sizeof(file_entry)
-    int entries_per_clus = bytes_per_clus / sizeof(file_entry);
-
-    int FAT_sectors = header->BPB_NumFATs * header->BPB_FATSz16;
-
-    BYTE* now_clus = (BYTE*)malloc(bytes_per_clus); // buffer for loading cluster
-    if (dir_clus_num == 0) {
-        // append in root directory
-        int root_head_sec = 1 + FAT_sectors;
-        int max_root_entries = header->BPB_RootEntCnt;
-
-        loadSectors(disk, root_head_sec, sec_per_clus, now_clus);
-        int total = 0, i = 0;
-        while (total < max_root_entries) {
-            file_entry* ent = &((file_entry*)now_clus)[i];
-
-            if (*(const BYTE*)ent == 0x00 || *(const BYTE*)ent == FILE_DEL_BYTE) {
-                // this position is empty or deleted
-                memcpy(ent, ent_to_append, sizeof(file_entry));
-                int offset = (total/entries_per_clus) * sec_per_clus;
-                writeSectors(disk, root_head_sec + offset, sec_per_clus, now_clus);
-                free(now_clus);
-                return 1;
-            }
-
-            ++total;
-            ++i;
-            if (i >= entries_per_clus) {
-                i = 0;
-                int offset = (total/entries_per_clus) * sec_per_clus;
-                loadSectors(disk, root_head_sec + offset, sec_per_clus, now_clus);
-            }
-        }
+int appendEntInDir(volume* vol, WORD dir_clus_num, const file_entry* ent_to_append) {
+    dir_index* index = getDirIndex(vol, dir_clus_num);
+    if (!index) return 0;
+    // checked again under the lock of the directory, in case the name is taken after the caller checked it
+    if (dirIndexFind(index, ent_to_append->DIR_Name)) return 0;
+    ent_loc loc; // where the entry is written
+    if (index->free_slot_count) {
+        // reuse the first deleted entry
+        loc = dirIndexPopFreeSlot(index);
+    } else if (index->has_end) {
+        loc = index->end;
+        advanceDirIndexEnd(vol, dir_clus_num, index);
     } else {
-        // append in normal subdirectory (non-root)
-        int root_bytes = header->BPB_RootEntCnt * sizeof(file_entry);
-        // assume bytes of root directory is a multiple of bytes per sector
-        int root_sectors = root_bytes / header->BPB_BytesPerSec;
-        int data_head_sec = 1 + FAT_sectors + root_sectors;
-
-        int now_clus_num = dir_clus_num;
-        int logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-        loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-        int i = 0;
-        while (1) {
-            file_entry* ent = &((file_entry*)now_clus)[i];
-
-            if (*(const BYTE*)ent == 0x00 || *(const BYTE*)ent == FILE_DEL_BYTE) {
-                // this position is empty or deleted
-                memcpy(ent, ent_to_append, sizeof(file_entry));
-                writeSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-                free(now_clus);
-                return 1;
-            }
-
-            ++i;
-            if (i >= entries_per_clus) {
-                i = 0;
-                WORD next_clus_num = getNextClusNumFromFAT(disk, now_clus_num);
-                if (clusNumIsEOF(next_clus_num)) {
-                    // We need a new cluster to store the new entry
-                    WORD alloc_clus_num = allocFATClus(disk, 1, now_clus_num);
-                    logic_sec_num = data_head_sec + (alloc_clus_num - 2) * sec_per_clus;
-                    memset(now_clus, 0, bytes_per_clus);
-                    ((file_entry*)now_clus)[0] = *ent_to_append;
-                    writeSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-                    free(now_clus);
-                    return 1;
-                }
-                now_clus_num = next_clus_num;
-                logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-                loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-            }
-        }
+        // probably there are too many entries in root
+        if (dir_clus_num == 0) return 0;
+        // We need a new cluster to store the new entry
+        WORD alloc_clus_num = allocFATClus(vol, 1, index->end_clus_num);
+        if (!alloc_clus_num) return 0;
+        loc.logic_sec_num = clusToLogicSec(vol, alloc_clus_num);
+        loc.slot = 0;
+        loc.ent_num = index->end.ent_num;
+        index->end = loc;
+        index->has_end = 1;
+        index->end_clus_num = alloc_clus_num;
+        advanceDirIndexEnd(vol, dir_clus_num, index);
     }
-    // if excutes here, probably there are too many entries in root
-    free(now_clus);
-    return 0;
+    writeEntAtLoc(vol, loc, ent_to_append);
+    // the entry is in the image already, so an index missing it is dropped and built again on next access
+    if (dirIndexInsert(index, ent_to_append->DIR_Name, loc) < 0) dropDirIndex(vol, dir_clus_num);
+    else listEntInDir(vol, index, loc);
+    return 1;
 }
 
 // write file content in buffer to disk according to file entry, return number of clusters written
 // assume the file entry has already been set with correct head cluster and file size
+// and the chain is allocated by `allocFATClusForWrite`, so that the rest of last cluster is clean
 // return 0 if file size doesn't match FAT record, but content written would not be recover
-int writeFileContentByEnt(floppy* disk, const file_entry* ent, const BYTE* buf) {
-    const fat12_header* header = (const fat12_header*)disk->storage;
-
-    int FAT_sectors = header->BPB_NumFATs * header->BPB_FATSz16;
-    int root_bytes = header->BPB_RootEntCnt * sizeof(file_entry);
-    // assume bytes of root directory is a multiple of bytes per sector
-    int root_sectors = root_bytes / header->BPB_BytesPerSec;
-    int data_head_sec = 1 + FAT_sectors + root_sectors;
-
-    int sec_per_clus = header->BPB_SecPerClus;
-    int bytes_per_clus = sec_per_clus * header->BPB_BytesPerSec;
+int writeFileContentByEnt(volume* vol, const file_entry* ent, const BYTE* buf) {
+    const DWORD bytes_per_clus = vol->bytes_per_clus;
+    const DWORD total = bytesToClusCount(vol, ent->DIR_FileSize);
 
     WORD cur_clus_num = ent->DIR_FstClus;
-    const BYTE* cur_clus = buf;
-    int counter = 0;
-    while(1) {
-        int logic_sec_num = data_head_sec + (cur_clus_num - 2) * sec_per_clus;
-
-        cur_clus_num = getNextClusNumFromFAT(disk, cur_clus_num);
-        ++counter;
-        if (clusNumIsEOF(cur_clus_num)) {
-            // fill the rest cluster with 0 to ensure the length is enough
-            BYTE* tmp = (BYTE*)malloc(bytes_per_clus);
-            memset(tmp, 0, bytes_per_clus);
-            int rest_size = ent->DIR_FileSize % bytes_per_clus;
-            if (rest_size == 0) rest_size = bytes_per_clus;
-            memcpy(tmp, cur_clus, rest_size);
-            writeSectors(disk, logic_sec_num, 1, tmp);
-            free(tmp);
-            break;
-        }
-        writeSectors(disk, logic_sec_num, sec_per_clus, cur_clus);
-        cur_clus = cur_clus + bytes_per_clus;
+    DWORD counter = 0;
+    while (counter < total && clusNumIsData(vol, cur_clus_num)) {
+        // write a run of continuous clusters at once
+        WORD run_head = cur_clus_num;
+        DWORD run_len = 0;
+        do {
+            ++run_len;
+            cur_clus_num = getNextClusNumFromFAT(vol, cur_clus_num);
+        } while (counter + run_len < total && cur_clus_num == run_head + run_len);
+        counter += run_len;
+        size_t size = (size_t)run_len * bytes_per_clus;
+        if (counter == total) size -= (size_t)total * bytes_per_clus - ent->DIR_FileSize; // the last one
+        size_t offset = logicSecToOffset(vol, clusToLogicSec(vol, run_head));
+        markDirty(vol->disk, offset, size);
+        memcpy(vol->disk->storage + offset, buf, size);
+        buf += size;
     }
-    // test if file size matches FAT record
-    if (counter != (ent->DIR_FileSize + bytes_per_clus-1)/bytes_per_clus) return 0;
-    return counter;
+    // test if file size matches FAT record, an empty file may hold one cluster or none
+    if (counter != total || (total > 0 && !clusNumIsEOF(cur_clus_num))) return 0;
+    return total ? total : 1;
+}
+
+// copy content of the file to the chain headed by `des_head_clus_num`, which should be long enough
+// return number of clusters copied, or 0 if the file size doesn't match FAT record
+int copyFileContentByEnt(volume* vol, const file_entry* src_ent, WORD des_head_clus_num) {
+    const DWORD bytes_per_clus = vol->bytes_per_clus;
+    const DWORD total = bytesToClusCount(vol, src_ent->DIR_FileSize);
+    BYTE* const storage = vol->disk->storage;
+
+    WORD src_clus_num = src_ent->DIR_FstClus;
+    WORD des_clus_num = des_head_clus_num;
+    DWORD counter = 0;
+    while (counter < total && clusNumIsData(vol, src_clus_num) && clusNumIsData(vol, des_clus_num)) {
+        // copy a run of clusters which are continuous in both chains at once
+        WORD src_run_head = src_clus_num;
+        WORD des_run_head = des_clus_num;
+        DWORD run_len = 0;
+        do {
+            ++run_len;
+            src_clus_num = getNextClusNumFromFAT(vol, src_clus_num);
+            des_clus_num = getNextClusNumFromFAT(vol, des_clus_num);
+        } while (counter + run_len < total
+            && src_clus_num == src_run_head + run_len
+            && des_clus_num == des_run_head + run_len);
+        counter += run_len;
+        size_t size = (size_t)run_len * bytes_per_clus;
+        if (counter == total) size -= (size_t)total * bytes_per_clus - src_ent->DIR_FileSize; // the last one
+        size_t des_offset = logicSecToOffset(vol, clusToLogicSec(vol, des_run_head));
+        markDirty(vol->disk, des_offset, size);
+        memcpy(storage + des_offset, storage + logicSecToOffset(vol, clusToLogicSec(vol, src_run_head)), size);
+    }
+    // test if file size matches FAT record, an empty file may hold one cluster or none
+    if (counter != total || (total > 0 && !clusNumIsEOF(src_clus_num))) return 0;
+    return total ? total : 1;
+}
+
+// return head cluster number of parent of the directory, which is 0 for root
+WORD getParentDirClusNum(const volume* vol, WORD dir_clus_num) {
+    static const BYTE dot_dot_name[11] = { '.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+    // ".." is looked up in the index like any other name, so walking up costs no scanning
+    dir_index* index = getDirIndex(vol, dir_clus_num);
+    if (!index) return 0;
+    const ent_loc* loc = dirIndexFind(index, dot_dot_name);
+    if (!loc) return 0; // root has no ".."
+    return entAtLoc(vol, *loc)->DIR_FstClus;
 }
 
 // judge if dir A is parent of dir B
-int isParent(const floppy* disk, WORD A_clus_num, WORD B_clus_num) {
+int isParent(const volume* vol, WORD A_clus_num, WORD B_clus_num) {
     if (A_clus_num == 0) return 1; // root must be parent of any directory
     while (B_clus_num != 0) {
         if (A_clus_num == B_clus_num) return 1;
-        file_entry* parent = getFileEntByName(disk, B_clus_num, "..");
-        B_clus_num = parent->DIR_FstClus;
-        free(parent);
+        B_clus_num = getParentDirClusNum(vol, B_clus_num);
     }
     return 0;
 }
 
-// remove all file (include directory, recursively) in directory
-// this function is not applicable to root
-void removeAllInDir(floppy* disk, WORD dir_clus_num) {
-    const fat12_header* header = (const fat12_header*)disk->storage;
+// free the directory and everything in it recursively, entry of the directory is not changed
+// entries in the tree are not marked as deleted, as all clusters holding them are freed
+int removeDirTree(volume* vol, WORD dir_clus_num) {
+    // read the whole tree before any chain is cut
+    ent_tree tree;
+    if (!getEntTree(vol, dir_clus_num, &tree)) return 0;
+    // every run has at least one cluster
+    free_extent* runs = (free_extent*)malloc(sizeof(free_extent) * vol->clus_count);
+    if (!runs) {
+        // chains are freed one by one, which needs no memory
+        for (DWORD k = 0; k < tree.size; ++k) {
+            if (tree.storage[k].ent.DIR_FstClus) freeFATClus(vol, tree.storage[k].ent.DIR_FstClus);
+        }
+        entTreeDestroy(&tree);
+        return 1;
+    }
+    int run_count = 0;
+    pthread_mutex_lock(&vol->alloc_lock);
+    for (DWORD k = 0; k < tree.size; ++k) {
+        const file_entry* ent = &tree.storage[k].ent;
+        // the cluster may be head of a removed directory, whose index must not be reused
+        if (ent->DIR_Attr & FILE_ATTR_DIR) dropDirIndex(vol, ent->DIR_FstClus);
+        cutFATChain(vol, ent->DIR_FstClus, runs, &run_count);
+    }
+    releaseFreeRuns(vol, runs, run_count);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    free(runs);
+    entTreeDestroy(&tree);
+    return 1;
+}
+
+// return 1 if the chain of the file matches its size, an empty file may hold one cluster or none
+static int fileChainMatches(const volume* vol, const file_entry* ent) {
+    const DWORD total = bytesToClusCount(vol, ent->DIR_FileSize);
+    WORD cur_clus_num = ent->DIR_FstClus;
+    DWORD counter = 0;
+    for (; counter < total && clusNumIsData(vol, cur_clus_num); ++counter) {
+        cur_clus_num = getNextClusNumFromFAT(vol, cur_clus_num);
+    }
+    return counter == total && (total == 0 || clusNumIsEOF(cur_clus_num));
+}
 
-    int sec_per_clus = header->BPB_SecPerClus;
-    int bytes_per_clus = sec_per_clus * header->BPB_BytesPerSec;
-    // assume bytes_per_clus is a multiple of sizeof(file_entry)
-    int entries_per_clus = bytes_per_clus / sizeof(file_entry);
+// count clusters needed to copy everything in the tree, return 0 if a file in it doesn't match FAT record
+static int countEntTreeClus(const volume* vol, const ent_tree* tree, DWORD* total) {
+    for (DWORD k = 0; k < tree->size; ++k) {
+        const ent_tree_node* node = &tree->storage[k];
+        if (node->ent.DIR_Attr & FILE_ATTR_DIR) {
+            // deleted entries are not copied, so the copy is compact with "." and ".." added
+            *total += bytesToClusCount(vol, (node->child_count + 2) * sizeof(file_entry));
+        } else {
+            if (!fileChainMatches(vol, &node->ent)) return 0;
+            DWORD file_clus = bytesToClusCount(vol, node->ent.DIR_FileSize);
+            *total += file_clus ? file_clus : 1; // an empty file still holds one cluster
+        }
+    }
+    return 1;
+}
 
-    int FAT_sectors = header->BPB_NumFATs * header->BPB_FATSz16;
+// cut `count` clusters from the head of the chain at `*cursor` as a chain of their own
+// return its head, and its tail is returned in `tail_clus`
+static WORD takeClusFromChain(volume* vol, WORD* cursor, DWORD count, WORD* tail_clus) {
+    WORD head_clus = *cursor;
+    WORD tail = head_clus;
+    for (DWORD i = 1; i < count; ++i) {
+        tail = getNextClusNumFromFAT(vol, tail);
+    }
+    *cursor = getNextClusNumFromFAT(vol, tail);
+    setFATEntry(vol, tail, EOF_CLUSTER_NUM);
+    *tail_clus = tail;
+    return head_clus;
+}
 
-    int root_bytes = header->BPB_RootEntCnt * sizeof(file_entry);
-    // assume bytes of root directory is a multiple of bytes per sector
-    int root_sectors = root_bytes / header->BPB_BytesPerSec;
-    int data_head_sec = 1 + FAT_sectors + root_sectors;
+// entries of a new directory are written one after another through its chain
+typedef struct dir_writer {
+    WORD    clus_num;
+    WORD    slot;
+} dir_writer;
 
-    BYTE* now_clus = (BYTE*)malloc(bytes_per_clus); // buffer for loading cluster
-    int now_clus_num = dir_clus_num;
-    int logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-    loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-    char ent_name[12]; // buffer for entry name
-    ent_name[11] = '\0';
-    int i = 0;
-    while (1) {
-        file_entry* ent = &((file_entry*)now_clus)[i];
+static void dirWriterPut(volume* vol, dir_writer* w, const file_entry* ent) {
+    if (w->slot == vol->entries_per_clus) { // the cluster is full
+        w->clus_num = getNextClusNumFromFAT(vol, w->clus_num);
+        w->slot = 0;
+    }
+    size_t offset = logicSecToOffset(vol, clusToLogicSec(vol, w->clus_num));
+    // mark the cluster as changed at once before its first entry is written
+    if (w->slot == 0) markDirty(vol->disk, offset, vol->bytes_per_clus);
+    file_entry* ents = (file_entry*)(vol->disk->storage + offset);
+    ents[w->slot++] = *ent;
+}
 
-        if (*(const BYTE*)ent == 0x00) {
-            writeSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-            break;
-        } else if (*(const BYTE*)ent != FILE_DEL_BYTE) {
-            memcpy(ent_name, ent->DIR_Name, 11);
-            if (strcmp(ent_name, ".          ") && strcmp(ent_name, "..         ")) {
-                // recursively delete
-                if (ent->DIR_Attr & FILE_ATTR_DIR) removeAllInDir(disk, ent->DIR_FstClus);
-                freeFATClus(disk, ent->DIR_FstClus);
-            }
-            *(BYTE*)ent = FILE_DEL_BYTE;
-        }
-
-        ++i;
-        if (i >= entries_per_clus) {
-            i = 0;
-            writeSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-            now_clus_num = getNextClusNumFromFAT(disk, now_clus_num);
-            if (clusNumIsEOF(now_clus_num)) break;
-            logic_sec_num = data_head_sec + (now_clus_num - 2) * sec_per_clus;
-            loadSectors(disk, logic_sec_num, sec_per_clus, now_clus);
-        }
-    }
-    free(now_clus);
-}
-
-// return 1 when succeed else return 0
-// for convenience this is a completement with low efficiency
-int copyDirInternalRecursion(floppy* disk,
-    const directory* dir,
-    const char* src,
-    int src_len,
-    const char* des,
-    int des_len,
-    const ent_tree* tree) {
-    char* src_buf = (char*)malloc(src_len + 14);
-    char* des_buf = (char*)malloc(des_len + 14);
-    memcpy(src_buf, src, src_len);
-    src_buf[src_len] = '/';
-    ++src_len;
-    char* src_next = src_buf + src_len;
-    memcpy(des_buf, des, des_len);
-    des_buf[des_len] = '/';
-    ++des_len;
-    char* des_next = des_buf + des_len;
-    for (size_t i = 0; i < tree->size; ++i) {
-        formatNameToNormal(tree->storage[i].ent.DIR_Name, src_next);
-        int len = strlen(src_next);
-        memcpy(des_next, src_next, len + 1);
-        if (tree->storage[i].sub_tree) { // directory
-            if (!makeDirByPath(disk, dir, des_buf)) {
-                free(src_buf);
-                free(des_buf);
-                return 0;
-            }
-            if (!copyDirInternalRecursion(disk, dir, 
-                    src_buf, src_len + len, 
-                    des_buf, des_len + len, 
-                    (ent_tree*)tree->storage[i].sub_tree)
-            ) {
-                removeDirByPath(disk, dir, des_buf);
-                free(src_buf);
-                free(des_buf);
-                return 0;
-            }
-        } else { // file
-            if (!copyFileByPath(disk, dir, src_buf, des_buf)) {
-                free(src_buf);
-                free(des_buf);
-                return 0;
-            }
+// fill the rest of the last cluster with 0, which marks the end of the directory
+static void dirWriterClose(volume* vol, dir_writer* w) {
+    zeroClusTail(vol, w->clus_num, w->slot * sizeof(file_entry));
+}
+
+// copy children of the `index`th node of the tree into the new directory, whose entry is `dir_ent`
+// clusters are taken from the chain at `*cursor`, which is long enough
+static void copyDirTreeClus(volume* vol, const ent_tree* tree, DWORD index, const file_entry* dir_ent,
+    WORD parent_clus_num, WORD* cursor)
+{
+    const ent_tree_node* node = &tree->storage[index];
+    WORD tail_clus;
+    dir_writer w;
+    w.clus_num = takeClusFromChain(vol, cursor,
+        bytesToClusCount(vol, (node->child_count + 2) * sizeof(file_entry)), &tail_clus);
+    w.slot = 0;
+    // create "." and ".." entries
+    file_entry ent = *dir_ent;
+    memcpy(ent.DIR_Name, ".          ", 11);
+    dirWriterPut(vol, &w, &ent);
+    ent.DIR_Name[1] = '.';
+    ent.DIR_FstClus = parent_clus_num;
+    dirWriterPut(vol, &w, &ent);
+
+    for (DWORD i = node->first_child; i < node->first_child + node->child_count; ++i) {
+        const file_entry* src_ent = &tree->storage[i].ent;
+        if (src_ent->DIR_Attr & FILE_ATTR_DIR) {
+            // the new directory is made the same as `makeDirByPath` does
+            file_entry sub_ent = *dir_ent;
+            memcpy(sub_ent.DIR_Name, src_ent->DIR_Name, 11);
+            sub_ent.DIR_FstClus = *cursor; // it takes clusters first
+            dirWriterPut(vol, &w, &sub_ent);
+            copyDirTreeClus(vol, tree, i, &sub_ent, dir_ent->DIR_FstClus, cursor);
+        } else {
+            // the copied file is the same as `copyFileByPath` makes
+            DWORD file_clus = bytesToClusCount(vol, src_ent->DIR_FileSize);
+            file_entry file_ent = *src_ent;
+            file_ent.DIR_WrtTime = dir_ent->DIR_WrtTime;
+            file_ent.DIR_WrtDate = dir_ent->DIR_WrtDate;
+            file_ent.DIR_FstClus = takeClusFromChain(vol, cursor, file_clus ? file_clus : 1, &tail_clus);
+            copyFileContentByEnt(vol, src_ent, file_ent.DIR_FstClus);
+            zeroClusTail(vol, tail_clus,
+                file_clus ? src_ent->DIR_FileSize - (file_clus - 1) * vol->bytes_per_clus : 0);
+            dirWriterPut(vol, &w, &file_ent);
         }
     }
-    free(src_buf);
-    free(des_buf);
+    dirWriterClose(vol, &w);
+}
+
+// copy the source directory and everything in it as a new directory in `des_dir_clus_num`
+// `newdir` is the entry of the new directory, whose head cluster is set here
+// return 1 when succeed, else return 0 and nothing is changed
+int copyDirTree(volume* vol, WORD src_dir_clus_num, WORD des_dir_clus_num, file_entry* newdir) {
+    // the source is read once, and both passes below walk the tree in memory
+    ent_tree tree;
+    if (!getEntTree(vol, src_dir_clus_num, &tree)) return 0;
+    // check everything before changing anything, so that copying never fails halfway
+    DWORD total = 0;
+    if (!countEntTreeClus(vol, &tree, &total) || total > vol->free_clus_count) {
+        entTreeDestroy(&tree);
+        return 0;
+    }
+    // all clusters are allocated at once, and cut into chains in the order they are used
+    WORD cursor = allocFATChain(vol, total, 0, NULL);
+    if (!cursor) {
+        entTreeDestroy(&tree);
+        return 0;
+    }
+    newdir->DIR_FstClus = cursor; // the new directory takes clusters first
+    if (!appendEntInDir(vol, des_dir_clus_num, newdir)) {
+        freeFATClus(vol, cursor);
+        entTreeDestroy(&tree);
+        return 0;
+    }
+    copyDirTreeClus(vol, &tree, 0, newdir, des_dir_clus_num, &cursor);
+    entTreeDestroy(&tree);
     return 1;
 }
\ No newline at end of file